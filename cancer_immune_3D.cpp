@@ -67,23 +67,91 @@
 
 #include "./cancer_immune_3D.h"
 
+#include <algorithm>
+
 Cell_Definition* pImmuneCell;
 Cell_Definition* pMacrophage;
 
+Cancer_Immune_Indices cancer_immune_indices;
+std::vector<Immune_Attack_Parameters> immune_attack_parameters;
+std::vector<Contact_Parameters> contact_parameters;
 
-// 2/21/2022 Set up the PhysiCell mechanics data structure.
-    // Set mechanics voxel size.
-double mechanics_voxel_size = 30;
-Cell_Container* cell_container = create_cell_container_for_microenvironment(
-    microenvironment, mechanics_voxel_size );
+// built by create_cancer_immune_context(), after the XML is parsed
+Cell_Container* cancer_immune_cell_container = NULL;
 
 
+void resolve_cancer_immune_indices( void )
+{
+    // all definitions share the custom variables of the defaults, in the same order
+    Custom_Cell_Data& data = cell_defaults.custom_data;
+    
+    cancer_immune_indices.oncoprotein = data.find_variable_index( "oncoprotein" );
+    cancer_immune_indices.elastic_coefficient = data.find_variable_index( "elastic_coefficient" );
+    cancer_immune_indices.kill_rate = data.find_variable_index( "kill_rate" );
+    cancer_immune_indices.attachment_lifetime = data.find_variable_index( "attachment_lifetime" );
+    cancer_immune_indices.attachment_rate = data.find_variable_index( "attachment_rate" );
+    cancer_immune_indices.oncoprotein_saturation = data.find_variable_index( "oncoprotein_saturation" );
+    cancer_immune_indices.oncoprotein_threshold = data.find_variable_index( "oncoprotein_threshold" );
+    cancer_immune_indices.max_attachment_distance = data.find_variable_index( "max_attachment_distance" );
+    cancer_immune_indices.min_attachment_distance = data.find_variable_index( "min_attachment_distance" );
+    cancer_immune_indices.PDL1 = data.find_variable_index( "PDL1" );
+    cancer_immune_indices.mutational_burden = data.find_variable_index( "mutational_burden" );
+    cancer_immune_indices.neoantigen_strength = data.find_variable_index( "neoantigen_strength" );
+    cancer_immune_indices.r1 = data.find_variable_index( "r1" );
+    cancer_immune_indices.docking_kill_time = data.find_variable_index( "docking_kill_time" );
+    cancer_immune_indices.docking_detach_time = data.find_variable_index( "docking_detach_time" );
+    cancer_immune_indices.death_recorded = data.find_variable_index( "death_recorded" );
+    
+    cancer_immune_indices.oxygen = microenvironment.find_density_index( "oxygen" );
+    cancer_immune_indices.immunostimulatory_factor = microenvironment.find_density_index( "immunostimulatory factor" );
+    cancer_immune_indices.IL4 = microenvironment.find_density_index( "IL4" );
+    cancer_immune_indices.IFNg = microenvironment.find_density_index( "IFNg" );
+    
+    cancer_immune_indices.apoptosis = cell_defaults.phenotype.death.find_death_model_index( "apoptosis" );
+    
+    return;
+}
+
+void cache_cell_type_parameters( void )
+{
+    int max_type = 0;
+    for( int n=0; n < cell_definitions_by_index.size(); n++ )
+    {
+        if( cell_definitions_by_index[n]->type > max_type )
+        { max_type = cell_definitions_by_index[n]->type; }
+    }
+    docking_events_scheduled = parameters.bools("docking_event_scheduling");
+    
+    immune_attack_parameters.assign( max_type+1 , Immune_Attack_Parameters() );
+    contact_parameters.assign( max_type+1 , Contact_Parameters() );
+    
+    for( int n=0; n < cell_definitions_by_index.size(); n++ )
+    {
+        Cell_Definition* pCD = cell_definitions_by_index[n];
+        Immune_Attack_Parameters& params = immune_attack_parameters[ pCD->type ];
+        
+        params.oncoprotein_saturation = pCD->custom_data[ cancer_immune_indices.oncoprotein_saturation ];
+        params.oncoprotein_threshold = pCD->custom_data[ cancer_immune_indices.oncoprotein_threshold ];
+        params.oncoprotein_difference = params.oncoprotein_saturation - params.oncoprotein_threshold;
+        
+        params.max_attachment_distance = pCD->custom_data[ cancer_immune_indices.max_attachment_distance ];
+        params.min_attachment_distance = pCD->custom_data[ cancer_immune_indices.min_attachment_distance ];
+        params.attachment_difference = params.max_attachment_distance - params.min_attachment_distance;
+        
+        Contact_Parameters& contact = contact_parameters[ pCD->type ];
+        double max_elastic_displacement = pCD->phenotype.geometry.radius * pCD->phenotype.mechanics.relative_detachment_distance;
+        contact.max_displacement_squared = max_elastic_displacement * max_elastic_displacement;
+        contact.elastic_constant = pCD->phenotype.mechanics.attachment_elastic_constant;
+    }
+    
+    return;
+}
+
 void create_immune_cell_type( void )
 {
     pImmuneCell = find_cell_definition( "immune cell" );
     
-    static int oxygen_ID = microenvironment.find_density_index( "oxygen" );
-    static int immuno_ID = microenvironment.find_density_index( "immunostimulatory factor" );
+    int oxygen_ID = cancer_immune_indices.oxygen;
     
     // reduce o2 uptake
     
@@ -98,20 +166,17 @@ void create_immune_cell_type( void )
     // figure out mechanics parameters
     
     pImmuneCell->phenotype.mechanics.relative_maximum_attachment_distance
-        = pImmuneCell->custom_data["max_attachment_distance"] / pImmuneCell->phenotype.geometry.radius ;
+        = pImmuneCell->custom_data[cancer_immune_indices.max_attachment_distance] / pImmuneCell->phenotype.geometry.radius ;
         
     pImmuneCell->phenotype.mechanics.attachment_elastic_constant
-        = pImmuneCell->custom_data["elastic_coefficient"];
+        = pImmuneCell->custom_data[cancer_immune_indices.elastic_coefficient];
     
     pImmuneCell->phenotype.mechanics.relative_detachment_distance
-        = pImmuneCell->custom_data["max_attachment_distance" ] / pImmuneCell->phenotype.geometry.radius ;
+        = pImmuneCell->custom_data[cancer_immune_indices.max_attachment_distance] / pImmuneCell->phenotype.geometry.radius ;
     
     // set functions
     
-    pImmuneCell->functions.update_phenotype = NULL;
-    pImmuneCell->functions.custom_cell_rule = immune_cell_rule;
-    pImmuneCell->functions.update_migration_bias = immune_cell_motility;
-    pImmuneCell->functions.contact_function = adhesion_contact_function;
+    install_policy<Immune_Cell_Policy>( pImmuneCell );
     
     // set custom data values
 
@@ -123,7 +188,7 @@ void create_macrophage_type( void )
 {
     pMacrophage = find_cell_definition( "macrophage" );
     
-    static int oxygen_ID = microenvironment.find_density_index( "oxygen" );
+    int oxygen_ID = cancer_immune_indices.oxygen;
     /*
     static int IFNg_ID = microenvironment.find_density_index( "IFNg" );
     static int IL4_ID = microenvironment.find_density_index( "IL4" );
@@ -150,9 +215,9 @@ void create_macrophage_type( void )
     */
     // set functions
     
-    pMacrophage->functions.update_phenotype = NULL;
-    pMacrophage->functions.custom_cell_rule = macrophage_rule;
-    pMacrophage->functions.update_migration_bias = macrophage_motility;
+    // the macrophage rule only does bookkeeping, so it runs once per
+    // phenotype step instead of every mechanics step
+    install_policy<Macrophage_Policy>( pMacrophage );
     // pMacrophage->functions.contact_function = macrophage_function;
     
     // set custom data values
@@ -163,13 +228,76 @@ void create_macrophage_type( void )
 
 
 
+bool batched_custom_rules = false;
+std::vector<int> cell_policy_by_type;
+
+template <class Policy>
+inline void apply_custom_cell_rule( Cell* pCell, double dt )
+{
+    if( Policy::has_custom_cell_rule )
+    { Policy::custom_cell_rule( pCell, pCell->phenotype, dt ); }
+    return;
+}
+
+void run_batched_custom_rules( double t )
+{
+    // same cadence as the core's mechanics step
+    static double last_mechanics_time = 0.0;
+    static bool first_call = true;
+    if( !batched_custom_rules )
+    { return; }
+    if( !first_call && t - last_mechanics_time < mechanics_dt - 1e-10 )
+    { return; }
+    first_call = false;
+    last_mechanics_time = t;
+    
+    double dt = mechanics_dt;
+    
+    #pragma omp parallel for
+    for( int i=0; i < all_cells->size(); i++ )
+    {
+        // types without a custom rule (cancer cells, macrophages) are
+        // skipped on the type alone
+        Cell* pCell = (*all_cells)[i];
+        if( pCell->type >= cell_policy_by_type.size() || cell_policy_by_type[ pCell->type ] == no_cell_policy )
+        { continue; }
+        if( pCell->is_out_of_domain )
+        { continue; }
+        
+        // a dead cell's rule runs once, to record the death; as on the
+        // pointer path, where it then clears its function, skip it after
+        if( pCell->phenotype.death.dead == true &&
+            pCell->custom_data[ cancer_immune_indices.death_recorded ] != 0.0 )
+        { continue; }
+        
+        switch( cell_policy_by_type[ pCell->type ] )
+        {
+            case cancer_cell_policy:
+                apply_custom_cell_rule<Cancer_Cell_Policy>( pCell, dt );
+                break;
+            case immune_cell_policy:
+                apply_custom_cell_rule<Immune_Cell_Policy>( pCell, dt );
+                break;
+            case macrophage_cell_policy:
+                apply_custom_cell_rule<Macrophage_Policy>( pCell, dt );
+                break;
+            default:
+                break;
+        }
+    }
+    
+    return;
+}
+
 void create_cell_types( void )
 {
     // use the same random seed so that future experiments have the
-    // same initial histogram of oncoprotein, even if threading means
-    // that future division and other events are still not identical
-    // for all runs
+    // same initial histogram of oncoprotein. the module's own events
+    // (attachment, apoptosis, detachment, recruitment) draw from counter-
+    // based streams keyed on this seed, so they are identical at any
+    // thread count; division and other core events are still not
     SeedRandom( parameters.ints("random_seed") );
+    initialize_counter_random( parameters.ints("random_seed") );
     
     // housekeeping
     
@@ -184,31 +312,27 @@ void create_cell_types( void )
     cell_defaults.parameters.o2_necrosis_threshold = 30;
 
 
-    static int oxygen_ID = microenvironment.find_density_index( "oxygen" ); // 0
-    static int immuno_ID = microenvironment.find_density_index( "immunostimulatory factor" ); // 1
-    
     /*
        This parses the cell definitions in the XML config file.
     */
 
     initialize_cell_definitions_from_pugixml();
     
+    // look up custom data, substrate and death model indices once
+    resolve_cancer_immune_indices();
     
     // change the max cell-cell adhesion distance
     cell_defaults.phenotype.mechanics.relative_maximum_attachment_distance =
-        cell_defaults.custom_data["max_attachment_distance"] / cell_defaults.phenotype.geometry.radius;
+        cell_defaults.custom_data[cancer_immune_indices.max_attachment_distance] / cell_defaults.phenotype.geometry.radius;
         
     cell_defaults.phenotype.mechanics.relative_detachment_distance
-        = cell_defaults.custom_data["max_attachment_distance"] / cell_defaults.phenotype.geometry.radius ;
+        = cell_defaults.custom_data[cancer_immune_indices.max_attachment_distance] / cell_defaults.phenotype.geometry.radius ;
         
     cell_defaults.phenotype.mechanics.attachment_elastic_constant
-        = cell_defaults.custom_data[ "elastic_coefficient" ];
+        = cell_defaults.custom_data[ cancer_immune_indices.elastic_coefficient ];
         
-    cell_defaults.functions.update_phenotype = tumor_cell_phenotype_with_and_immune_stimulation;
-    cell_defaults.functions.custom_cell_rule = NULL;
-    
-    cell_defaults.functions.contact_function = adhesion_contact_function;
-    cell_defaults.functions.update_migration_bias = NULL;
+    batched_custom_rules = parameters.bools("batched_custom_rules");
+    install_policy<Cancer_Cell_Policy>( &cell_defaults );
 
     // create the immune cell type
     create_immune_cell_type();
@@ -217,22 +341,757 @@ void create_cell_types( void )
     create_macrophage_type();
     
     build_cell_definitions_maps();
+    
+    // substrates the definitions secrete are solved from the start
+    activate_substrates_secreted_by_definitions();
+    
+    // colors for SVG output
+    build_cancer_immune_palette();
+    
+    // per-thread buffers for attach / detach requests
+    initialize_attachment_requests();
+    
+    // ring buffer of recent deaths for T cell recruitment
+    initialize_death_ledger();
+    
+    // per-definition attack thresholds, distances and contact constants
+    cache_cell_type_parameters();
+    
+    // per-type extents, which need the number of types
+    initialize_spatial_extents();
+    
+    initialize_section_timing();
+    
     display_cell_definitions( std::cout );
     
     return;
 }
 
-void setup_microenvironment( void )
+void setup_microenvironment( void )
+{
+    
+    if( default_microenvironment_options.simulate_2D == true )
+    {
+        std::cout << "Warning: overriding 2D setting to return to 3D" << std::endl;
+        default_microenvironment_options.simulate_2D = false;
+    }
+    
+    initialize_microenvironment();
+    
+    // solve substrate by substrate, skipping the inert ones
+    initialize_substrate_activity();
+    initialize_quasi_steady_substrates();
+    initialize_cached_gradients();
+    microenvironment.diffusion_decay_solver = cancer_immune_diffusion_solver;
+
+    return;
+}
+
+// rough population for the initial tissue: the close-packed tumor sphere
+// (one cell per 6 r^3), the initial macrophages, and the T cells
+int expected_initial_cell_count( void )
+{
+    double cell_radius = cell_defaults.phenotype.geometry.radius;
+    double tumor_radius = parameters.doubles("tumor_radius");
+    double tumor_cells = 4.1887902047863905 * pow( tumor_radius , 3 ) / ( 6.0 * pow( cell_radius , 3 ) );
+    
+    return (int) tumor_cells + parameters.ints("number_of_initial_macrophages") +
+        parameters.ints("number_of_immune_cells");
+}
+
+Cell_Container* create_cancer_immune_context( void )
+{
+    if( cancer_immune_cell_container != NULL )
+    { return cancer_immune_cell_container; }
+    
+    double mechanics_voxel_size = parameters.doubles("mechanics_voxel_size");
+    cancer_immune_cell_container = create_cell_container_for_microenvironment( microenvironment, mechanics_voxel_size );
+    
+    // grow the agent list once, not by doubling during setup_tissue()
+    all_cells->reserve( expected_initial_cell_count() );
+    
+    return cancer_immune_cell_container;
+}
+
+// nonzero for substrates the solver has to advance
+std::vector<char> substrate_active;
+
+// implicit 1-D solve coefficients for one substrate and direction
+struct Thomas_Coefficients
+{
+    double coupling; // D dt / dx^2
+    std::vector<double> inverse_denominators;
+    std::vector<double> upper; // modified upper diagonal
+};
+
+std::vector< std::vector<Thomas_Coefficients> > thomas_coefficients; // [substrate][direction]
+double thomas_coefficients_dt = -1.0;
+
+// multi-rate stepping: substrate s is advanced by substrate_steps[s]*dt
+// once every substrate_steps[s] solver calls
+std::vector<int> substrate_steps;
+long long diffusion_step_count = 0;
+
+void initialize_substrate_activity( void )
+{
+    Microenvironment& M = microenvironment;
+    int number_of_substrates = M.density_names.size();
+    substrate_active.assign( number_of_substrates , 0 );
+    
+    for( int s=0; s < number_of_substrates; s++ )
+    {
+        if( s < default_microenvironment_options.Dirichlet_activation_vector.size() &&
+            default_microenvironment_options.Dirichlet_activation_vector[s] )
+        { substrate_active[s] = 1; }
+    }
+    
+    // nonzero initial conditions
+    for( int n=0; n < M.mesh.voxels.size(); n++ )
+    {
+        std::vector<double>& densities = M(n);
+        for( int s=0; s < number_of_substrates; s++ )
+        {
+            if( densities[s] != 0.0 )
+            { substrate_active[s] = 1; }
+        }
+    }
+    
+    return;
+}
+
+void activate_substrates_secreted_by_definitions( void )
+{
+    for( int n=0; n < cell_definitions_by_index.size(); n++ )
+    {
+        Secretion& secretion = cell_definitions_by_index[n]->phenotype.secretion;
+        for( int s=0; s < substrate_active.size(); s++ )
+        {
+            if( secretion.secretion_rates[s] != 0.0 || secretion.net_export_rates[s] != 0.0 )
+            { substrate_active[s] = 1; }
+        }
+    }
+    
+    for( int s=0; s < substrate_active.size(); s++ )
+    {
+        std::cout << microenvironment.density_names[s] << ": "
+                  << ( substrate_active[s] ? "solved" : "inert until first secretion" ) << std::endl;
+    }
+    
+    return;
+}
+
+void activate_substrate( int substrate_index )
+{
+    char active;
+    #pragma omp atomic read
+    active = substrate_active[substrate_index];
+    if( active )
+    { return; }
+    
+    #pragma omp atomic write
+    substrate_active[substrate_index] = 1;
+    return;
+}
+
+bool substrate_is_active( int substrate_index )
+{
+    return substrate_active[substrate_index] != 0;
+}
+
+void set_secretion_rate( Phenotype& phenotype, int substrate_index, double rate )
+{
+    phenotype.secretion.secretion_rates[substrate_index] = rate;
+    if( rate != 0.0 )
+    { activate_substrate( substrate_index ); }
+    return;
+}
+
+void prepare_thomas_coefficients( Thomas_Coefficients& coefficients, int n, double spacing, double diffusion_coefficient, double decay_rate, double dt )
+{
+    // each of the three directional solves takes a third of the decay
+    double c = diffusion_coefficient * dt / ( spacing * spacing );
+    double decay = decay_rate * dt / 3.0;
+    
+    coefficients.coupling = c;
+    coefficients.inverse_denominators.assign( n , 0.0 );
+    coefficients.upper.assign( n , 0.0 );
+    
+    double previous_upper = 0.0;
+    for( int i=0; i < n; i++ )
+    {
+        // no-flux ends have one neighbor only
+        double diagonal = 1.0 + decay + 2.0*c;
+        if( i == 0 )
+        { diagonal -= c; }
+        if( i == n-1 )
+        { diagonal -= c; }
+        
+        double denominator = diagonal;
+        if( i > 0 )
+        { denominator -= c * previous_upper; }
+        
+        coefficients.inverse_denominators[i] = 1.0 / denominator;
+        coefficients.upper[i] = c / denominator;
+        previous_upper = coefficients.upper[i];
+    }
+    
+    return;
+}
+
+void choose_substrate_steps( Microenvironment& M, double dt )
+{
+    // slow substrates take the largest step that keeps D dt / dx^2 below
+    // diffusion_substep_max_coupling, but never more than one mechanics
+    // step, and always a divisor of it so every field is current when the
+    // mechanics step reads it
+    double max_coupling = parameters.doubles("diffusion_substep_max_coupling");
+    
+    int steps_per_mechanics = (int) round( mechanics_dt / dt );
+    if( steps_per_mechanics < 1 )
+    { steps_per_mechanics = 1; }
+    
+    double spacing = M.mesh.dx;
+    if( M.mesh.dy < spacing )
+    { spacing = M.mesh.dy; }
+    if( M.mesh.z_coordinates.size() > 1 && M.mesh.dz < spacing )
+    { spacing = M.mesh.dz; }
+    
+    int number_of_substrates = M.density_names.size();
+    substrate_steps.assign( number_of_substrates , 1 );
+    
+    for( int s=0; s < number_of_substrates; s++ )
+    {
+        int steps = 1;
+        if( max_coupling > 0.0 )
+        {
+            steps = steps_per_mechanics;
+            if( M.diffusion_coefficients[s] > 0.0 )
+            { steps = (int) floor( max_coupling * spacing * spacing / ( M.diffusion_coefficients[s] * dt ) + 1e-9 ); }
+        }
+        if( steps < 1 )
+        { steps = 1; }
+        if( steps > steps_per_mechanics )
+        { steps = steps_per_mechanics; }
+        while( steps_per_mechanics % steps != 0 )
+        { steps--; }
+        
+        substrate_steps[s] = steps;
+        std::cout << M.density_names[s] << ": diffusion step " << steps*dt << " min" << std::endl;
+    }
+    
+    return;
+}
+
+void prepare_all_thomas_coefficients( Microenvironment& M, double dt )
+{
+    choose_substrate_steps( M, dt );
+    
+    int number_of_substrates = M.density_names.size();
+    thomas_coefficients.resize( number_of_substrates , std::vector<Thomas_Coefficients>( 3 ) );
+    
+    for( int s=0; s < number_of_substrates; s++ )
+    {
+        double substrate_dt = substrate_steps[s] * dt;
+        prepare_thomas_coefficients( thomas_coefficients[s][0], M.mesh.x_coordinates.size(), M.mesh.dx, M.diffusion_coefficients[s], M.decay_rates[s], substrate_dt );
+        prepare_thomas_coefficients( thomas_coefficients[s][1], M.mesh.y_coordinates.size(), M.mesh.dy, M.diffusion_coefficients[s], M.decay_rates[s], substrate_dt );
+        prepare_thomas_coefficients( thomas_coefficients[s][2], M.mesh.z_coordinates.size(), M.mesh.dz, M.diffusion_coefficients[s], M.decay_rates[s], substrate_dt );
+    }
+    thomas_coefficients_dt = dt;
+    diffusion_step_count = 0;
+    
+    return;
+}
+
+// solve one line of voxels (start, start+stride, ...) in place
+void thomas_solve_line( Microenvironment& M, int s, int start, int stride, const Thomas_Coefficients& coefficients )
+{
+    int n = coefficients.inverse_denominators.size();
+    double c = coefficients.coupling;
+    
+    // forward sweep
+    M(start)[s] *= coefficients.inverse_denominators[0];
+    for( int i=1; i < n; i++ )
+    {
+        int voxel = start + i*stride;
+        M(voxel)[s] = ( M(voxel)[s] + c*M(voxel-stride)[s] ) * coefficients.inverse_denominators[i];
+    }
+    
+    // back substitution
+    for( int i=n-2; i >= 0; i-- )
+    {
+        int voxel = start + i*stride;
+        M(voxel)[s] += coefficients.upper[i] * M(voxel+stride)[s];
+    }
+    
+    return;
+}
+
+// one directional (0: x, 1: y, 2: z) implicit solve of substrate s
+void diffusion_decay_substrate_sweep( Microenvironment& M, int s, int direction )
+{
+    int nx = M.mesh.x_coordinates.size();
+    int ny = M.mesh.y_coordinates.size();
+    int nz = M.mesh.z_coordinates.size();
+    const Thomas_Coefficients& coefficients = thomas_coefficients[s][direction];
+    
+    if( direction == 0 )
+    {
+        #pragma omp parallel for
+        for( int line=0; line < ny*nz; line++ )
+        { thomas_solve_line( M, s, nx*line, 1, coefficients ); }
+        return;
+    }
+    
+    if( direction == 1 )
+    {
+        #pragma omp parallel for
+        for( int line=0; line < nx*nz; line++ )
+        {
+            int i = line % nx;
+            int k = line / nx;
+            thomas_solve_line( M, s, i + nx*ny*k, nx, coefficients );
+        }
+        return;
+    }
+    
+    #pragma omp parallel for
+    for( int line=0; line < nx*ny; line++ )
+    { thomas_solve_line( M, s, line, nx*ny, coefficients ); }
+    
+    return;
+}
+
+// quasi-steady-state substrates: instead of being stepped in time, the
+// field is the solution of D lap(u) - lambda u - uptake + secretion = 0,
+// re-solved by conjugate gradients once per phenotype step, or sooner if
+// the total uptake changes by more than quasi_steady_uptake_tolerance
+std::vector<Quasi_Steady_State> quasi_steady_states; // by substrate
+
+void initialize_quasi_steady_substrates( void )
+{
+    Microenvironment& M = microenvironment;
+    quasi_steady_states.assign( M.density_names.size() , Quasi_Steady_State() );
+    
+    // comma-separated substrate names
+    std::string names = parameters.strings("quasi_steady_substrates");
+    std::size_t start = 0;
+    while( start <= names.size() )
+    {
+        std::size_t end = names.find( ',' , start );
+        if( end == std::string::npos )
+        { end = names.size(); }
+        
+        std::string name = names.substr( start , end - start );
+        name.erase( 0 , name.find_first_not_of( " \t" ) );
+        name.erase( name.find_last_not_of( " \t" ) + 1 );
+        
+        if( name.size() > 0 )
+        {
+            int s = M.find_density_index( name );
+            if( s < 0 )
+            { std::cout << "Warning: quasi-steady substrate " << name << " not found" << std::endl; }
+            else
+            {
+                Quasi_Steady_State& state = quasi_steady_states[s];
+                state.enabled = true;
+                state.solved = false;
+                state.total_uptake_at_solve = 0.0;
+                state.field.assign( M.mesh.voxels.size() , 0.0 );
+                state.uptake.assign( M.mesh.voxels.size() , 0.0 );
+                state.source.assign( M.mesh.voxels.size() , 0.0 );
+                state.fixed.assign( M.mesh.voxels.size() , 0 );
+                state.diagonal.assign( M.mesh.voxels.size() , 1.0 );
+                state.rhs.assign( M.mesh.voxels.size() , 0.0 );
+                state.r.assign( M.mesh.voxels.size() , 0.0 );
+                state.z.assign( M.mesh.voxels.size() , 0.0 );
+                state.p.assign( M.mesh.voxels.size() , 0.0 );
+                state.Ap.assign( M.mesh.voxels.size() , 0.0 );
+                std::cout << name << ": quasi-steady state" << std::endl;
+            }
+        }
+        start = end + 1;
+    }
+    
+    return;
+}
+
+bool substrate_is_quasi_steady( int substrate_index )
+{
+    return quasi_steady_states[substrate_index].enabled;
+}
+
+// per-voxel linear uptake coefficient and source from the cells, matching
+// the implicit source / sink update BioFVM applies to each agent
+double assemble_quasi_steady_sources( Microenvironment& M, int s, Quasi_Steady_State& state )
+{
+    std::fill( state.uptake.begin(), state.uptake.end(), 0.0 );
+    std::fill( state.source.begin(), state.source.end(), 0.0 );
+    
+    double total_uptake = 0.0;
+    
+    #pragma omp parallel for reduction(+:total_uptake)
+    for( int i=0; i < all_cells->size(); i++ )
+    {
+        Cell* pCell = (*all_cells)[i];
+        if( pCell->is_out_of_domain )
+        { continue; }
+        int voxel = pCell->get_current_voxel_index();
+        if( voxel < 0 )
+        { continue; }
+        
+        Secretion& secretion = pCell->phenotype.secretion;
+        double volume_ratio = pCell->phenotype.volume.total / M.mesh.dV;
+        double uptake = ( secretion.uptake_rates[s] + secretion.secretion_rates[s] ) * volume_ratio;
+        double source = secretion.secretion_rates[s] * secretion.saturation_densities[s] * volume_ratio
+            + secretion.net_export_rates[s] / M.mesh.dV;
+        
+        #pragma omp atomic
+        state.uptake[voxel] += uptake;
+        #pragma omp atomic
+        state.source[voxel] += source;
+        
+        total_uptake += uptake;
+    }
+    
+    return total_uptake;
+}
+
+// Jacobi-preconditioned conjugate gradients, warm-started from the last
+// solution. Dirichlet voxels are held at their current values and moved
+// to the right-hand side, which keeps the system symmetric.
+void solve_quasi_steady_substrate( Microenvironment& M, int s, Quasi_Steady_State& state )
+{
+    int nx = M.mesh.x_coordinates.size();
+    int ny = M.mesh.y_coordinates.size();
+    int nz = M.mesh.z_coordinates.size();
+    int number_of_voxels = nx*ny*nz;
+    
+    double coupling[3] = { 0.0 , 0.0 , 0.0 };
+    coupling[0] = M.diffusion_coefficients[s] / ( M.mesh.dx * M.mesh.dx );
+    coupling[1] = M.diffusion_coefficients[s] / ( M.mesh.dy * M.mesh.dy );
+    coupling[2] = M.diffusion_coefficients[s] / ( M.mesh.dz * M.mesh.dz );
+    int strides[3] = { 1 , nx , nx*ny };
+    int counts[3] = { nx , ny , nz };
+    
+    bool dirichlet = s < default_microenvironment_options.Dirichlet_activation_vector.size() &&
+        default_microenvironment_options.Dirichlet_activation_vector[s];
+    
+    std::vector<char>& fixed = state.fixed;
+    std::vector<double>& diagonal = state.diagonal;
+    std::vector<double>& rhs = state.rhs;
+    std::vector<double>& r = state.r;
+    std::vector<double>& z = state.z;
+    std::vector<double>& p = state.p;
+    std::vector<double>& Ap = state.Ap;
+    std::vector<double>& x = state.field;
+    
+    // neighbor n of voxel v in direction d (side -1 or +1), or -1 at a no-flux edge
+    #define QSS_NEIGHBOR( v , d , side ) \
+        ( ( ( (v) / strides[d] ) % counts[d] + (side) < 0 || ( (v) / strides[d] ) % counts[d] + (side) >= counts[d] ) ? -1 : (v) + (side)*strides[d] )
+    
+    for( int v=0; v < number_of_voxels; v++ )
+    {
+        fixed[v] = 0;
+        if( dirichlet && M.mesh.voxels[v].is_Dirichlet )
+        {
+            fixed[v] = 1;
+            x[v] = M(v)[s];
+        }
+        else if( !state.solved )
+        { x[v] = M(v)[s]; }
+    }
+    
+    #pragma omp parallel for
+    for( int v=0; v < number_of_voxels; v++ )
+    {
+        if( fixed[v] )
+        {
+            diagonal[v] = 1.0;
+            rhs[v] = x[v];
+            continue;
+        }
+        diagonal[v] = M.decay_rates[s] + state.uptake[v];
+        rhs[v] = state.source[v];
+        for( int d=0; d < 3; d++ )
+        {
+            for( int side=-1; side <= 1; side += 2 )
+            {
+                int n = QSS_NEIGHBOR( v , d , side );
+                if( n < 0 )
+                { continue; }
+                diagonal[v] += coupling[d];
+                if( fixed[n] )
+                { rhs[v] += coupling[d] * x[n]; }
+            }
+        }
+    }
+    
+    // r = rhs - A x
+    double rhs_norm2 = 0.0;
+    double rz = 0.0;
+    #pragma omp parallel for reduction(+:rhs_norm2,rz)
+    for( int v=0; v < number_of_voxels; v++ )
+    {
+        double Ax = diagonal[v] * x[v];
+        if( !fixed[v] )
+        {
+            for( int d=0; d < 3; d++ )
+            {
+                for( int side=-1; side <= 1; side += 2 )
+                {
+                    int n = QSS_NEIGHBOR( v , d , side );
+                    if( n >= 0 && !fixed[n] )
+                    { Ax -= coupling[d] * x[n]; }
+                }
+            }
+        }
+        r[v] = rhs[v] - Ax;
+        z[v] = r[v] / diagonal[v];
+        p[v] = z[v];
+        rhs_norm2 += rhs[v]*rhs[v];
+        rz += r[v]*z[v];
+    }
+    
+    double tolerance = parameters.doubles("quasi_steady_tolerance");
+    int max_iterations = parameters.ints("quasi_steady_max_iterations");
+    double tolerance2 = tolerance*tolerance*( rhs_norm2 + 1e-300 );
+    
+    int iteration = 0;
+    double r_norm2 = tolerance2 + 1.0;
+    while( iteration < max_iterations )
+    {
+        double pAp = 0.0;
+        #pragma omp parallel for reduction(+:pAp)
+        for( int v=0; v < number_of_voxels; v++ )
+        {
+            double value = diagonal[v] * p[v];
+            if( !fixed[v] )
+            {
+                for( int d=0; d < 3; d++ )
+                {
+                    for( int side=-1; side <= 1; side += 2 )
+                    {
+                        int n = QSS_NEIGHBOR( v , d , side );
+                        if( n >= 0 && !fixed[n] )
+                        { value -= coupling[d] * p[n]; }
+                    }
+                }
+            }
+            Ap[v] = value;
+            pAp += p[v]*value;
+        }
+        if( pAp <= 0.0 )
+        { break; }
+        
+        double alpha = rz / pAp;
+        double rz_new = 0.0;
+        r_norm2 = 0.0;
+        #pragma omp parallel for reduction(+:rz_new,r_norm2)
+        for( int v=0; v < number_of_voxels; v++ )
+        {
+            x[v] += alpha * p[v];
+            r[v] -= alpha * Ap[v];
+            z[v] = r[v] / diagonal[v];
+            rz_new += r[v]*z[v];
+            r_norm2 += r[v]*r[v];
+        }
+        iteration++;
+        if( r_norm2 <= tolerance2 )
+        { break; }
+        
+        double beta = rz_new / rz;
+        rz = rz_new;
+        #pragma omp parallel for
+        for( int v=0; v < number_of_voxels; v++ )
+        { p[v] = z[v] + beta * p[v]; }
+    }
+    
+    #undef QSS_NEIGHBOR
+    
+    if( r_norm2 > tolerance2 )
+    {
+        std::cout << "Warning: quasi-steady " << M.density_names[s] << " did not converge in "
+                  << iteration << " iterations" << std::endl;
+    }
+    
+    state.solved = true;
+    return;
+}
+
+void advance_quasi_steady_substrate( Microenvironment& M, int s, double dt )
+{
+    Quasi_Steady_State& state = quasi_steady_states[s];
+    
+    int steps_per_mechanics = (int) round( mechanics_dt / dt );
+    int steps_per_phenotype = (int) round( phenotype_dt / dt );
+    if( steps_per_mechanics < 1 )
+    { steps_per_mechanics = 1; }
+    if( steps_per_phenotype < 1 )
+    { steps_per_phenotype = 1; }
+    long long step = diffusion_step_count - 1;
+    
+    // check the uptake once per mechanics step, solve at least once per phenotype step
+    if( !state.solved || step % steps_per_mechanics == 0 )
+    {
+        double total_uptake = assemble_quasi_steady_sources( M, s, state );
+        double change = fabs( total_uptake - state.total_uptake_at_solve );
+        
+        if( !state.solved || step % steps_per_phenotype == 0 ||
+            change > parameters.doubles("quasi_steady_uptake_tolerance") * ( state.total_uptake_at_solve + 1e-15 ) )
+        {
+            solve_quasi_steady_substrate( M, s, state );
+            state.total_uptake_at_solve = total_uptake;
+        }
+    }
+    
+    // cells changed the field through their sources and sinks since the
+    // last call; put the settled field back
+    #pragma omp parallel for
+    for( int v=0; v < state.field.size(); v++ )
+    { M(v)[s] = state.field[v]; }
+    
+    return;
+}
+
+// lazy gradients: a voxel's gradient of substrate s is computed the first
+// time a cell asks for it after a solver step, and memoized until the next
+// step. substrates nobody samples never get a finite-difference sweep.
+// a voxel's stamp is the epoch its entry is valid for, or minus that
+// epoch while one thread fills it.
+long long gradient_epoch = 1; // bumped once per solver call
+std::vector< std::vector<double> > cached_gradients; // [substrate][3*voxel]
+std::vector< std::vector< std::atomic<long long> > > cached_gradient_epochs; // [substrate][voxel]
+
+void initialize_cached_gradients( void )
+{
+    Microenvironment& M = microenvironment;
+    int number_of_voxels = M.mesh.voxels.size();
+    
+    cached_gradients.assign( M.density_names.size() , std::vector<double>() );
+    cached_gradient_epochs.clear();
+    cached_gradient_epochs.resize( M.density_names.size() );
+    for( int s=0; s < M.density_names.size(); s++ )
+    {
+        cached_gradients[s].assign( 3*number_of_voxels , 0.0 );
+        
+        // atomics are neither copyable nor initialized by default
+        cached_gradient_epochs[s] = std::vector< std::atomic<long long> >( number_of_voxels );
+        for( int n=0; n < number_of_voxels; n++ )
+        { cached_gradient_epochs[s][n].store( 0 ); }
+    }
+    
+    return;
+}
+
+// same differences as BioFVM's compute_gradient_vector: centered inside,
+// one-sided on the domain faces
+double substrate_gradient_component( Microenvironment& M, int s, int voxel, int stride, int index, int count, double spacing )
+{
+    if( count < 2 )
+    { return 0.0; }
+    if( index == 0 )
+    { return ( M(voxel+stride)[s] - M(voxel)[s] ) / spacing; }
+    if( index == count-1 )
+    { return ( M(voxel)[s] - M(voxel-stride)[s] ) / spacing; }
+    return ( M(voxel+stride)[s] - M(voxel-stride)[s] ) / ( 2.0*spacing );
+}
+
+void cached_nearest_gradient( Cell* pCell, int substrate_index, double gradient[3] )
+{
+    gradient[0] = 0.0;
+    gradient[1] = 0.0;
+    gradient[2] = 0.0;
+    int voxel = pCell->get_current_voxel_index();
+    if( voxel < 0 )
+    { return; }
+    
+    Microenvironment& M = microenvironment;
+    std::vector<double>& cache = cached_gradients[substrate_index];
+    std::atomic<long long>& stamp = cached_gradient_epochs[substrate_index][voxel];
+    long long epoch = gradient_epoch;
+    
+    long long seen = stamp.load( std::memory_order_acquire );
+    if( seen == epoch )
+    {
+        gradient[0] = cache[3*voxel];
+        gradient[1] = cache[3*voxel+1];
+        gradient[2] = cache[3*voxel+2];
+        return;
+    }
+    
+    int nx = M.mesh.x_coordinates.size();
+    int ny = M.mesh.y_coordinates.size();
+    int nz = M.mesh.z_coordinates.size();
+    int i = voxel % nx;
+    int j = ( voxel / nx ) % ny;
+    int k = voxel / ( nx*ny );
+    
+    gradient[0] = substrate_gradient_component( M, substrate_index, voxel, 1, i, nx, M.mesh.dx );
+    gradient[1] = substrate_gradient_component( M, substrate_index, voxel, nx, j, ny, M.mesh.dy );
+    gradient[2] = substrate_gradient_component( M, substrate_index, voxel, nx*ny, k, nz, M.mesh.dz );
+    
+    // claim the voxel before filling it, so exactly one thread writes the
+    // entry and readers only see the stamp once the values are in place.
+    // a thread that loses the claim keeps its own copy and moves on.
+    if( seen != -epoch && stamp.compare_exchange_strong( seen , -epoch , std::memory_order_acquire ) )
+    {
+        cache[3*voxel] = gradient[0];
+        cache[3*voxel+1] = gradient[1];
+        cache[3*voxel+2] = gradient[2];
+        
+        stamp.store( epoch , std::memory_order_release );
+    }
+    
+    return;
+}
+
+void cancer_immune_diffusion_solver( Microenvironment& M, double dt )
 {
+    // the solver runs serially between cell updates, before any cell is
+    // added or removed again: run the batched rules, if on, and apply
+    // what they and the last update recorded
+    run_batched_custom_rules( PhysiCell_globals.current_time );
+    resolve_attachment_requests();
     
-    if( default_microenvironment_options.simulate_2D == true )
+    CANCER_IMMUNE_TIMED_BATCH( timed_diffusion );
+    
+    if( dt != thomas_coefficients_dt )
+    { prepare_all_thomas_coefficients( M, dt ); }
+    
+    diffusion_step_count++;
+    CANCER_IMMUNE_TIMED_ITEMS( timed_diffusion , M.mesh.voxels.size() );
+    
+    // same x, y, z splitting as BioFVM, with Dirichlet nodes reset after each direction
+    for( int direction=0; direction < 3; direction++ )
     {
-        std::cout << "Warning: overriding 2D setting to return to 3D" << std::endl;
-        default_microenvironment_options.simulate_2D = false;
+        for( int s=0; s < substrate_active.size(); s++ )
+        {
+            // identically zero with no sources: nothing to do
+            if( substrate_active[s] == 0 )
+            { continue; }
+            
+            // slow substrates only move at the end of their longer step;
+            // sources and sinks keep accumulating in between
+            if( diffusion_step_count % substrate_steps[s] != 0 )
+            { continue; }
+            
+            if( quasi_steady_states[s].enabled )
+            { continue; }
+            
+            diffusion_decay_substrate_sweep( M, s, direction );
+        }
+        M.apply_dirichlet_conditions();
     }
     
-    initialize_microenvironment();
-
+    for( int s=0; s < substrate_active.size(); s++ )
+    {
+        if( substrate_active[s] && quasi_steady_states[s].enabled )
+        { advance_quasi_steady_substrate( M, s, dt ); }
+    }
+    
+    // every cached gradient is now stale
+    gradient_epoch++;
+    
     return;
 }
 
@@ -285,35 +1144,173 @@ void introduce_immune_cells( void )
 }
 */
 
-std::vector<std::vector<double>> create_cell_sphere_positions(double cell_radius, double sphere_radius)
+// one close-packed lattice clipped to a sphere at the origin
+struct Sphere_Lattice
 {
-    std::vector<std::vector<double>> cells;
-    int xc=0,yc=0,zc=0;
-    double x_spacing= cell_radius*sqrt(3);
-    double y_spacing= cell_radius*2;
-    double z_spacing= cell_radius*sqrt(3);
-    
-    std::vector<double> tempPoint(3,0.0);
-    // std::vector<double> cylinder_center(3,0.0);
+    double cell_radius;
+    double radius_squared;
+    double start; // -sphere_radius
+    double x_spacing, y_spacing, z_spacing;
+    int number_of_layers, number_of_rows, number_of_columns;
+};
+
+// visit( x, y, z ) for each lattice point of layer k strictly inside the
+// sphere. Layers are z_spacing apart and every other layer is shifted by
+// half a cell in x; within a layer every other row is shifted by one cell
+// radius in y. Only the y range that can cut the sphere is walked.
+template <typename Visitor>
+void walk_sphere_lattice_layer( const Sphere_Lattice& lattice, int k, Visitor visit )
+{
+    double z = lattice.start + k*lattice.z_spacing;
+    double layer_remaining = lattice.radius_squared - z*z;
+    if( layer_remaining <= 0.0 )
+    { return; }
     
-    for(double z=-sphere_radius;z<sphere_radius;z+=z_spacing, zc++)
+    for( int i=0; i < lattice.number_of_rows; i++ )
     {
-        for(double x=-sphere_radius;x<sphere_radius;x+=x_spacing, xc++)
+        double x = lattice.start + i*lattice.x_spacing + (k%2) * 0.5 * lattice.cell_radius;
+        double row_remaining = layer_remaining - x*x;
+        if( row_remaining <= 0.0 )
+        { continue; }
+        
+        // candidate columns, padded by one on each side; each point is
+        // still tested exactly below
+        double y_start = lattice.start + (i%2) * lattice.cell_radius;
+        double half_width = sqrt( row_remaining );
+        int first = (int) ceil( ( -half_width - y_start ) / lattice.y_spacing ) - 1;
+        int last = (int) floor( ( half_width - y_start ) / lattice.y_spacing ) + 1;
+        if( first < 0 )
+        { first = 0; }
+        if( last > lattice.number_of_columns - 1 )
+        { last = lattice.number_of_columns - 1; }
+        
+        for( int j=first; j <= last; j++ )
         {
-            for(double y=-sphere_radius;y<sphere_radius;y+=y_spacing, yc++)
-            {
-                tempPoint[0]=x + (zc%2) * 0.5 * cell_radius;
-                tempPoint[1]=y + (xc%2) * cell_radius;
-                tempPoint[2]=z;
-                
-                if(sqrt(norm_squared(tempPoint))< sphere_radius)
-                { cells.push_back(tempPoint); }
-            }
-            
+            double y = y_start + j*lattice.y_spacing;
+            if( x*x + y*y + z*z < lattice.radius_squared )
+            { visit( x, y, z ); }
         }
     }
-    return cells;
+    return;
+}
+
+// hexagonal close packing inside a sphere, as x,y,z triples in one flat
+// buffer. Layers are counted in parallel, given their offsets into the
+// buffer, then filled in parallel.
+std::vector<double> create_cell_sphere_positions( double cell_radius, double sphere_radius )
+{
+    Sphere_Lattice lattice;
+    lattice.cell_radius = cell_radius;
+    lattice.radius_squared = sphere_radius*sphere_radius;
+    lattice.start = -sphere_radius;
+    lattice.x_spacing = cell_radius*sqrt(3.0);
+    lattice.y_spacing = cell_radius*2.0;
+    lattice.z_spacing = cell_radius*sqrt(3.0);
+    lattice.number_of_layers = (int) ceil( 2.0*sphere_radius / lattice.z_spacing );
+    lattice.number_of_rows = (int) ceil( 2.0*sphere_radius / lattice.x_spacing );
+    lattice.number_of_columns = (int) ceil( 2.0*sphere_radius / lattice.y_spacing );
+    
+    int number_of_layers = lattice.number_of_layers;
+    std::vector<int> layer_offsets( number_of_layers + 1 , 0 );
+    
+    #pragma omp parallel for
+    for( int k=0; k < number_of_layers; k++ )
+    {
+        int count = 0;
+        walk_sphere_lattice_layer( lattice , k , [&count]( double x, double y, double z ) { count++; } );
+        layer_offsets[k+1] = count;
+    }
+    for( int k=0; k < number_of_layers; k++ )
+    { layer_offsets[k+1] += layer_offsets[k]; }
+    
+    std::vector<double> positions( 3*layer_offsets[number_of_layers] , 0.0 );
+    
+    #pragma omp parallel for
+    for( int k=0; k < number_of_layers; k++ )
+    {
+        double* out = positions.data() + 3*layer_offsets[k];
+        walk_sphere_lattice_layer( lattice , k , [&out]( double x, double y, double z )
+            {
+                out[0] = x;
+                out[1] = y;
+                out[2] = z;
+                out += 3;
+            } );
+    }
+    
+    return positions;
+}
+
+Running_Summary::Running_Summary() : count(0), mean(0.0), M2(0.0), min(9e99), max(-9e99)
+{}
+
+// Welford's update
+void Running_Summary::add( double value )
+{
+    count++;
+    double delta = value - mean;
+    mean += delta / count;
+    M2 += delta * ( value - mean );
+    
+    if( value < min )
+    { min = value; }
+    if( value > max )
+    { max = value; }
+    return;
+}
+
+// Chan et al.'s pairwise combination
+void Running_Summary::merge( const Running_Summary& other )
+{
+    if( other.count == 0 )
+    { return; }
+    if( count == 0 )
+    {
+        *this = other;
+        return;
+    }
+    
+    long long total = count + other.count;
+    double delta = other.mean - mean;
+    mean += delta * other.count / total;
+    M2 += other.M2 + delta * delta * ( (double) count * other.count / total );
+    count = total;
+    
+    if( other.min < min )
+    { min = other.min; }
+    if( other.max > max )
+    { max = other.max; }
+    return;
+}
+
+double Running_Summary::standard_deviation( void ) const
+{
+    if( count < 2 )
+    { return 0.0; }
+    return sqrt( M2 / ( count - 1.0 ) );
+}
+
+void write_histogram( std::string filename, const Running_Summary& summary, const std::vector<long long>& histogram, double histogram_max )
+{
+    std::ofstream csv( filename.c_str() );
+    if( !csv )
+    {
+        std::cout << "Warning: could not write " << filename << std::endl;
+        return;
+    }
+    
+    int number_of_bins = histogram.size() - 1;
+    double bin_width = histogram_max / number_of_bins;
+    
+    csv << "# count,mean,standard_deviation,min,max" << std::endl;
+    csv << "# " << summary.count << "," << summary.mean << "," << summary.standard_deviation()
+        << "," << summary.min << "," << summary.max << std::endl;
+    csv << "bin_lower,bin_upper,count" << std::endl;
+    for( int n=0; n < number_of_bins; n++ )
+    { csv << n*bin_width << "," << (n+1)*bin_width << "," << histogram[n] << std::endl; }
+    csv << histogram_max << ",inf," << histogram[number_of_bins] << std::endl;
     
+    return;
 }
 
 void setup_tissue( void )
@@ -380,51 +1377,70 @@ void setup_tissue( void )
     double tumor_radius =
         parameters.doubles("tumor_radius"); // 250.0;
     
-    Cell* pCell = NULL;
     // for macrophage
     Cell* pC = NULL;
     
-    std::vector<std::vector<double>> positions = create_cell_sphere_positions(cell_radius,tumor_radius);
-    std::cout << "creating " << positions.size() << " closely-packed tumor cells ... " << std::endl;
+    std::vector<double> positions = create_cell_sphere_positions(cell_radius,tumor_radius);
+    std::cout << "creating " << positions.size() / 3 << " closely-packed tumor cells ... " << std::endl;
     
     static double imm_mean = parameters.doubles("tumor_mean_immunogenicity");
     static double imm_sd = parameters.doubles("tumor_immunogenicity_standard_deviation");
-        
-    for( int i=0; i < positions.size(); i++ )
-    {
-        pCell = create_cell(); // tumor cell
-        pCell->assign_position( positions[i] );
-        pCell->custom_data["oncoprotein"] = NormalRandom( imm_mean, imm_sd );
-        if( pCell->custom_data["oncoprotein"] < 0.0 )
-        { pCell->custom_data["oncoprotein"] = 0.0; }
-    }
     
-    double sum = 0.0;
-    double min = 9e9;
-    double max = -9e9;
-    for( int i=0; i < all_cells->size() ; i++ )
+    std::vector<Cell*> tumor_cells = create_cells_at_positions( cell_defaults , positions );
+    
+    // draw and summarize in one parallel pass; the counter-based streams
+    // give every cell the same value at any thread count
+    int oncoprotein_i = cancer_immune_indices.oncoprotein;
+    int number_of_bins = parameters.ints("oncoprotein_histogram_bins");
+    double histogram_max = parameters.doubles("oncoprotein_histogram_max");
+    
+    std::vector<Running_Summary> summaries( omp_get_max_threads() );
+    std::vector< std::vector<long long> > histograms( omp_get_max_threads() );
+    
+    #pragma omp parallel
     {
-        double r = (*all_cells)[i]->custom_data["oncoprotein"];
-        sum += r;
-        if( r < min )
-        { min = r; }
-        if( r > max )
-        { max = r; }
+        // accumulate privately, and hand over once per thread at the end
+        Running_Summary local_summary;
+        std::vector<long long> local_histogram( number_of_bins + 1 , 0 );
+        
+        #pragma omp for
+        for( int i=0; i < tumor_cells.size(); i++ )
+        {
+            double oncoprotein = counter_normal_random( random_event_oncoprotein, tumor_cells[i]->ID, 0, imm_mean, imm_sd );
+            if( oncoprotein < 0.0 )
+            { oncoprotein = 0.0; }
+            tumor_cells[i]->custom_data[oncoprotein_i] = oncoprotein;
+            
+            local_summary.add( oncoprotein );
+            
+            // the last bin collects everything at or above histogram_max
+            int bin = (int) ( oncoprotein / histogram_max * number_of_bins );
+            if( bin > number_of_bins )
+            { bin = number_of_bins; }
+            local_histogram[bin]++;
+        }
+        
+        int thread = omp_get_thread_num();
+        summaries[thread] = local_summary;
+        histograms[thread].swap( local_histogram );
     }
-    double mean = sum / ( all_cells->size() + 1e-15 );
-    // compute standard deviation
-    sum = 0.0;
-    for( int i=0; i < all_cells->size(); i++ )
+    
+    Running_Summary summary;
+    std::vector<long long> histogram( number_of_bins + 1 , 0 );
+    for( int t=0; t < summaries.size(); t++ )
     {
-        sum +=  ( (*all_cells)[i]->custom_data["oncoprotein"] - mean )*( (*all_cells)[i]->custom_data["oncoprotein"] - mean );
+        summary.merge( summaries[t] );
+        for( int n=0; n < histograms[t].size(); n++ )
+        { histogram[n] += histograms[t][n]; }
     }
-    double standard_deviation = sqrt( sum / ( all_cells->size() - 1.0 + 1e-15 ) );
     
     std::cout << std::endl << "Oncoprotein summary: " << std::endl
               << "===================" << std::endl;
-    std::cout << "mean: " << mean << std::endl;
-    std::cout << "standard deviation: " << standard_deviation << std::endl;
-    std::cout << "[min max]: [" << min << " " << max << "]" << std::endl << std::endl;
+    std::cout << "mean: " << summary.mean << std::endl;
+    std::cout << "standard deviation: " << summary.standard_deviation() << std::endl;
+    std::cout << "[min max]: [" << summary.min << " " << summary.max << "]" << std::endl << std::endl;
+    
+    write_histogram( PhysiCell_settings.folder + "/initial_oncoprotein.csv" , summary , histogram , histogram_max );
     
     // 3/8 seed in macrophages randomly throughout the tumor core
     for (int i = 0; i < parameters.ints("number_of_initial_macrophages"); i++)
@@ -454,17 +1470,16 @@ void setup_tissue( void )
 // custom cell phenotype function to scale immunostimulatory factor with hypoxia
 void tumor_cell_phenotype_with_and_immune_stimulation( Cell* pCell, Phenotype& phenotype, double dt )
 {
+    CANCER_IMMUNE_TIMED_SCOPE( timed_tumor_phenotype );
+    
     static int cycle_start_index = live.find_phase_index( PhysiCell_constants::live );
     static int cycle_end_index = live.find_phase_index( PhysiCell_constants::live );
-    static int oncoprotein_i = pCell->custom_data.find_variable_index( "oncoprotein" );
     
     // update secretion rates based on hypoxia
     
-    static int o2_index = microenvironment.find_density_index( "oxygen" );
-    static int immune_factor_index = microenvironment.find_density_index( "immunostimulatory factor" );
-    double o2 = pCell->nearest_density_vector()[o2_index];
+    int immune_factor_index = cancer_immune_indices.immunostimulatory_factor;
 
-    phenotype.secretion.secretion_rates[immune_factor_index] = 10.0;
+    set_secretion_rate( phenotype, immune_factor_index, 10.0 );
     
     update_cell_and_death_parameters_O2_based(pCell,phenotype,dt);
     
@@ -472,101 +1487,358 @@ void tumor_cell_phenotype_with_and_immune_stimulation( Cell* pCell, Phenotype& p
     // set it to secrete the immunostimulatory factor
     if( phenotype.death.dead == true )
     {
-        phenotype.secretion.secretion_rates[immune_factor_index] = 10;
+        set_secretion_rate( phenotype, immune_factor_index, 10 );
         pCell->functions.update_phenotype = NULL;
+        record_cell_death( pCell );
         return;
     }
     
+    add_to_spatial_extent( pCell );
+    
     // if cell is attached to immune cell but doesn't die, become PDL1+ which (in another function) will turn future death rate to 0
     if( pCell->state.attached_cells.size() > 0 && pCell->phenotype.death.dead == false)
     {
-        pCell -> custom_data["PDL1"] = 0; // 0 corresponds to PDL1+, 1 to PDL1-
+        pCell -> custom_data[cancer_immune_indices.PDL1] = 0; // 0 corresponds to PDL1+, 1 to PDL1-
     }
 
 
     // multiply proliferation rate by the oncoprotein
-    phenotype.cycle.data.transition_rate( cycle_start_index ,cycle_end_index ) *= pCell->custom_data[oncoprotein_i] ;
+    phenotype.cycle.data.transition_rate( cycle_start_index ,cycle_end_index ) *= pCell->custom_data[cancer_immune_indices.oncoprotein] ;
     
     return;
 }
 
-std::vector<std::string> cancer_immune_coloring_function( Cell* pCell )
+std::vector<unsigned int> cancer_immune_palette_rgba;
+std::vector<std::string> cancer_immune_palette_strings;
+
+void set_palette_color( int color_id, int red, int green, int blue, const char* name )
+{
+    cancer_immune_palette_rgba[color_id] = ( (unsigned int) red << 24 ) | ( (unsigned int) green << 16 ) | ( (unsigned int) blue << 8 ) | 255u;
+    
+    if( name )
+    {
+        cancer_immune_palette_strings[color_id] = name;
+        return;
+    }
+    char szTempString [128];
+    sprintf( szTempString , "rgb(%u,%u,%u)", red, green, blue );
+    cancer_immune_palette_strings[color_id].assign( szTempString );
+    return;
+}
+
+void build_cancer_immune_palette( void )
 {
-    static int oncoprotein_i = pCell->custom_data.find_variable_index( "oncoprotein" );
+    cancer_immune_palette_rgba.assign( number_of_cancer_immune_colors , 0 );
+    cancer_immune_palette_strings.assign( number_of_cancer_immune_colors , "" );
+    
+    // live tumor cells: rgb(q,q,255-q) for quantized oncoprotein q, and the
+    // same color at half intensity for the nucleus
+    for( int q=0; q < 256; q++ )
+    {
+        set_palette_color( color_oncoprotein_shade + q , q , q , 255-q , NULL );
+        set_palette_color( color_oncoprotein_nucleus + q , (int) round( q/2.0 ) , (int) round( q/2.0 ) , (int) round( (255-q)/2.0 ) , NULL );
+    }
     
+    // keep the SVG color names for the fixed colors
+    set_palette_color( color_black , 0 , 0 , 0 , "black" );
+    set_palette_color( color_lime , 0 , 255 , 0 , "lime" );
+    set_palette_color( color_green , 0 , 128 , 0 , "green" );
+    set_palette_color( color_gold , 255 , 215 , 0 , "gold" );
+    set_palette_color( color_darkcyan , 0 , 139 , 139 , "darkcyan" );
+    set_palette_color( color_cyan , 0 , 255 , 255 , "cyan" );
+    set_palette_color( color_hotpink , 255 , 105 , 180 , "hotpink" );
+    set_palette_color( color_apoptotic , 255 , 0 , 0 , NULL );
+    set_palette_color( color_apoptotic_nucleus , 125 , 0 , 0 , NULL );
+    set_palette_color( color_necrotic , 250 , 138 , 38 , NULL );
+    set_palette_color( color_necrotic_nucleus , 139 , 69 , 19 , NULL );
+    
+    return;
+}
+
+unsigned int cancer_immune_color_rgba( unsigned short color_id )
+{
+    return cancer_immune_palette_rgba[color_id];
+}
+
+const std::string& cancer_immune_color_string( unsigned short color_id )
+{
+    return cancer_immune_palette_strings[color_id];
+}
+
+Cell_Color_IDs cancer_immune_color_ids( Cell* pCell )
+{
     // immune are black
-    std::vector< std::string > output( 4, "black" );
+    Cell_Color_IDs output = { color_black , color_black , color_black , color_black };
     
     if( pCell->type == 1 )
     {
-        output[0] = "lime";
-        output[1] = "lime";
-        output[2] = "green";
+        output.cytoplasm = color_lime;
+        output.cytoplasm_outline = color_lime;
+        output.nucleus = color_green;
         return output;
     }
     
     // macrophages are gold
     if ( pCell->type == 2)
     {
-        output[0] = "gold";
-        output[1] = "gold";
-        output[2] = "gold";
+        output.cytoplasm = color_gold;
+        output.cytoplasm_outline = color_gold;
+        output.nucleus = color_gold;
         return output;
     }
 
     // if I'm under attack, color me
     if( pCell->state.attached_cells.size() > 0 )
     {
-        output[0] = "darkcyan"; // orangered // "purple"; // 128,0,128
-        output[1] = "black"; // "magenta";
-        output[2] = "cyan"; // "magenta"; //255,0,255
+        output.cytoplasm = color_darkcyan;
+        output.cytoplasm_outline = color_black;
+        output.nucleus = color_cyan;
         return output;
     }
     
     // CUSTOM
     // if cell is attacked but survives, turn pink and STAY PINK
-    if( (pCell->state.attached_cells.size() > 0 && pCell->phenotype.death.dead == false) || (pCell->custom_data["PDL1"] == 0) )
+    if( (pCell->state.attached_cells.size() > 0 && pCell->phenotype.death.dead == false) || (pCell->custom_data[cancer_immune_indices.PDL1] == 0) )
     {
-        output[0]="hotpink";
-        output[1]="hotpink";
-        output[2]="hotpink";
+        output.cytoplasm = color_hotpink;
+        output.cytoplasm_outline = color_hotpink;
+        output.nucleus = color_hotpink;
         return output;
     }
     
     // live cells are green, but shaded by oncoprotein value
     if( pCell->phenotype.death.dead == false )
     {
-        int oncoprotein = (int) round( 0.5 * pCell->custom_data[oncoprotein_i] * 255.0 );
-        char szTempString [128];
-        sprintf( szTempString , "rgb(%u,%u,%u)", oncoprotein, oncoprotein, 255-oncoprotein );
-        output[0].assign( szTempString );
-        output[1].assign( szTempString );
-
-        sprintf( szTempString , "rgb(%u,%u,%u)", (int)round(output[0][0]/2.0) , (int)round(output[0][1]/2.0) , (int)round(output[0][2]/2.0) );
-        output[2].assign( szTempString );
+        int oncoprotein = (int) round( 0.5 * pCell->custom_data[cancer_immune_indices.oncoprotein] * 255.0 );
+        if( oncoprotein < 0 )
+        { oncoprotein = 0; }
+        if( oncoprotein > 255 )
+        { oncoprotein = 255; }
         
+        output.cytoplasm = color_oncoprotein_shade + oncoprotein;
+        output.cytoplasm_outline = color_oncoprotein_shade + oncoprotein;
+        output.nucleus = color_oncoprotein_nucleus + oncoprotein;
         return output;
     }
 
     // if not, dead colors
+    int code = pCell->phenotype.cycle.current_phase().code;
     
-    if (pCell->phenotype.cycle.current_phase().code == PhysiCell_constants::apoptotic )  // Apoptotic - Red
+    if( code == PhysiCell_constants::apoptotic )  // Apoptotic - Red
     {
-        output[0] = "rgb(255,0,0)";
-        output[2] = "rgb(125,0,0)";
+        output.cytoplasm = color_apoptotic;
+        output.nucleus = color_apoptotic_nucleus;
     }
     
     // Necrotic - Brown
-    if( pCell->phenotype.cycle.current_phase().code == PhysiCell_constants::necrotic_swelling ||
-        pCell->phenotype.cycle.current_phase().code == PhysiCell_constants::necrotic_lysed ||
-        pCell->phenotype.cycle.current_phase().code == PhysiCell_constants::necrotic )
+    if( code == PhysiCell_constants::necrotic_swelling ||
+        code == PhysiCell_constants::necrotic_lysed ||
+        code == PhysiCell_constants::necrotic )
     {
-        output[0] = "rgb(250,138,38)";
-        output[2] = "rgb(139,69,19)";
+        output.cytoplasm = color_necrotic;
+        output.nucleus = color_necrotic_nucleus;
     }
     return output;
 }
 
+std::vector<std::string> cancer_immune_coloring_function( Cell* pCell )
+{
+    // SVG_plot wants strings, so copy them from the palette rather than
+    // formatting them for every cell
+    Cell_Color_IDs colors = cancer_immune_color_ids( pCell );
+    
+    std::vector< std::string > output( 4 );
+    output[0] = cancer_immune_palette_strings[ colors.cytoplasm ];
+    output[1] = cancer_immune_palette_strings[ colors.cytoplasm_outline ];
+    output[2] = cancer_immune_palette_strings[ colors.nucleus ];
+    output[3] = cancer_immune_palette_strings[ colors.nucleus_outline ];
+    return output;
+}
+
+Snapshot_Writer snapshot_writer;
+
+Snapshot_Writer::Snapshot_Writer()
+{
+    queued[0] = false;
+    queued[1] = false;
+    fill_index = 0;
+    running = false;
+    stopping = false;
+    return;
+}
+
+Snapshot_Writer::~Snapshot_Writer()
+{
+    stop();
+    return;
+}
+
+void Snapshot_Writer::start( void )
+{
+    if( running )
+    { return; }
+    
+    stopping = false;
+    running = true;
+    writer_thread = std::thread( &Snapshot_Writer::run , this );
+    return;
+}
+
+void Snapshot_Writer::stop( void )
+{
+    if( !running )
+    { return; }
+    
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    condition.notify_all();
+    writer_thread.join();
+    running = false;
+    return;
+}
+
+void Snapshot_Writer::queue( const std::string& filename_base, double time )
+{
+    start();
+    
+    // wait until the writer is done with the buffer we are about to fill
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        while( queued[fill_index] )
+        { condition.wait( lock ); }
+    }
+    
+    // the writer never touches a buffer that isn't queued, so fill it unlocked
+    Cell_Snapshot& snapshot = buffers[fill_index];
+    snapshot.filename_base = filename_base;
+    snapshot.time = time;
+    snapshot.bounding_box = microenvironment.mesh.bounding_box;
+    snapshot.records.resize( all_cells->size() );
+    
+    #pragma omp parallel for
+    for( int i=0; i < all_cells->size(); i++ )
+    {
+        Cell* pCell = (*all_cells)[i];
+        Cell_Snapshot_Record& record = snapshot.records[i];
+        
+        record.position[0] = pCell->position[0];
+        record.position[1] = pCell->position[1];
+        record.position[2] = pCell->position[2];
+        record.radius = pCell->phenotype.geometry.radius;
+        record.nuclear_radius = pCell->phenotype.geometry.nuclear_radius;
+        record.ID = pCell->ID;
+        record.type = pCell->type;
+        record.oncoprotein = pCell->custom_data[cancer_immune_indices.oncoprotein];
+        record.PDL1 = pCell->custom_data[cancer_immune_indices.PDL1];
+        record.dead = pCell->phenotype.death.dead;
+        record.phase_code = pCell->phenotype.cycle.current_phase().code;
+        record.colors = cancer_immune_color_ids( pCell );
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        queued[fill_index] = true;
+        write_queue.push_back( fill_index );
+    }
+    condition.notify_all();
+    
+    fill_index = 1 - fill_index;
+    return;
+}
+
+void Snapshot_Writer::run( void )
+{
+    while( true )
+    {
+        int index;
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            while( write_queue.empty() && !stopping )
+            { condition.wait( lock ); }
+            // finish anything already queued before stopping
+            if( write_queue.empty() )
+            { return; }
+            index = write_queue.front();
+            write_queue.pop_front();
+        }
+        
+        write( buffers[index] );
+        
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            queued[index] = false;
+        }
+        condition.notify_all();
+    }
+}
+
+void Snapshot_Writer::write( const Cell_Snapshot& snapshot )
+{
+    const std::vector<Cell_Snapshot_Record>& records = snapshot.records;
+    
+    std::ofstream csv( ( snapshot.filename_base + ".csv" ).c_str() );
+    csv << "ID,type,x,y,z,radius,oncoprotein,PDL1,dead,phase" << std::endl;
+    for( int i=0; i < records.size(); i++ )
+    {
+        const Cell_Snapshot_Record& record = records[i];
+        csv << record.ID << "," << record.type << ","
+            << record.position[0] << "," << record.position[1] << "," << record.position[2] << ","
+            << record.radius << "," << record.oncoprotein << "," << record.PDL1 << ","
+            << (int) record.dead << "," << record.phase_code << "\n";
+    }
+    csv.close();
+    
+    // cross-section through z = 0, with y pointing up
+    double x_min = snapshot.bounding_box[0];
+    double y_max = snapshot.bounding_box[4];
+    double width = snapshot.bounding_box[3] - snapshot.bounding_box[0];
+    double height = snapshot.bounding_box[4] - snapshot.bounding_box[1];
+    
+    std::ofstream svg( ( snapshot.filename_base + ".svg" ).c_str() );
+    svg << "<?xml version=\"1.0\" standalone=\"no\"?>" << std::endl
+        << "<svg width=\"" << width << "\" height=\"" << height << "\" xmlns=\"http://www.w3.org/2000/svg\">" << std::endl
+        << "<rect x=\"0\" y=\"0\" width=\"" << width << "\" height=\"" << height << "\" fill=\"white\"/>" << std::endl;
+    
+    for( int i=0; i < records.size(); i++ )
+    {
+        const Cell_Snapshot_Record& record = records[i];
+        double z = record.position[2];
+        if( fabs( z ) >= record.radius )
+        { continue; }
+        
+        double cx = record.position[0] - x_min;
+        double cy = y_max - record.position[1];
+        
+        svg << "<circle cx=\"" << cx << "\" cy=\"" << cy << "\" r=\"" << sqrt( record.radius*record.radius - z*z )
+            << "\" fill=\"" << cancer_immune_color_string( record.colors.cytoplasm )
+            << "\" stroke=\"" << cancer_immune_color_string( record.colors.cytoplasm_outline ) << "\" stroke-width=\"0.5\"/>\n";
+        
+        if( fabs( z ) < record.nuclear_radius )
+        {
+            svg << "<circle cx=\"" << cx << "\" cy=\"" << cy << "\" r=\"" << sqrt( record.nuclear_radius*record.nuclear_radius - z*z )
+                << "\" fill=\"" << cancer_immune_color_string( record.colors.nucleus )
+                << "\" stroke=\"" << cancer_immune_color_string( record.colors.nucleus_outline ) << "\" stroke-width=\"0.5\"/>\n";
+        }
+    }
+    
+    svg << "<text x=\"10\" y=\"20\" font-size=\"16\" font-family=\"Arial\">Current time: "
+        << snapshot.time << " min</text>" << std::endl
+        << "</svg>" << std::endl;
+    svg.close();
+    
+    return;
+}
+
+void queue_cell_snapshot( std::string filename_base, double time )
+{
+    CANCER_IMMUNE_TIMED_SCOPE( timed_output );
+    
+    snapshot_writer.queue( filename_base , time );
+    return;
+}
+
 /*
 void add_elastic_velocity( Cell* pActingOn, Cell* pAttachedTo , double elastic_constant )
 {
@@ -651,26 +1923,212 @@ void dettach_cells( Cell* pCell_1 , Cell* pCell_2 )
             }
             i++;
         }
-
+
+    }
+    
+    return;
+}
+*/
+
+// attach / detach requests, one buffer per OpenMP thread
+std::vector< std::vector<Attachment_Request> > attachment_requests_by_thread;
+
+// docked pairs, recorded once per pair (by the attacker) during the rule pass
+std::vector< std::vector<Attached_Pair> > attached_pairs_by_thread;
+
+void initialize_attachment_requests( void )
+{
+    attachment_requests_by_thread.resize( omp_get_max_threads() );
+    attached_pairs_by_thread.resize( omp_get_max_threads() );
+    return;
+}
+
+void request_attachment( Cell* pAttacker, Cell* pTarget )
+{
+    Attachment_Request request = { pAttacker , pTarget , attach_request };
+    attachment_requests_by_thread[ omp_get_thread_num() ].push_back( request );
+    return;
+}
+
+void request_detachment( Cell* pAttacker, Cell* pTarget )
+{
+    // a pair may be detached from either side; store it lowest ID first
+    // so that both requests collapse into one
+    if( pTarget->ID < pAttacker->ID )
+    { std::swap( pAttacker, pTarget ); }
+    
+    Attachment_Request request = { pAttacker , pTarget , detach_request };
+    attachment_requests_by_thread[ omp_get_thread_num() ].push_back( request );
+    return;
+}
+
+void request_kill( Cell* pAttacker, Cell* pTarget )
+{
+    Attachment_Request request = { pAttacker , pTarget , kill_request };
+    attachment_requests_by_thread[ omp_get_thread_num() ].push_back( request );
+    return;
+}
+
+bool attachment_request_order( const Attachment_Request& a, const Attachment_Request& b )
+{
+    // kills, then detachments, then attachments; each by attacker ID,
+    // then by target ID
+    if( a.kind != b.kind )
+    { return a.kind < b.kind; }
+    if( a.pAttacker->ID != b.pAttacker->ID )
+    { return a.pAttacker->ID < b.pAttacker->ID; }
+    return a.pTarget->ID < b.pTarget->ID;
+}
+
+// these only run in the serial merge below, so no critical section
+void add_attached_cell( Cell* pCell, Cell* pOther )
+{
+    std::vector<Cell*>& attached = pCell->state.attached_cells;
+    if( std::find( attached.begin(), attached.end(), pOther ) == attached.end() )
+    { attached.push_back( pOther ); }
+    return;
+}
+
+void remove_attached_cell( Cell* pCell, Cell* pOther )
+{
+    std::vector<Cell*>& attached = pCell->state.attached_cells;
+    for( int i=0; i < attached.size(); i++ )
+    {
+        if( attached[i] == pOther )
+        {
+            // copy last entry to current position, then shrink by one
+            attached[i] = attached.back();
+            attached.pop_back();
+            return;
+        }
+    }
+    return;
+}
+
+void record_attached_pair( Cell* pAttacker, Cell* pTarget )
+{
+    Attached_Pair pair = { pAttacker , pTarget };
+    attached_pairs_by_thread[ omp_get_thread_num() ].push_back( pair );
+    return;
+}
+
+double attached_displacement( Cell* pFrom, Cell* pTo, double displacement[3] )
+{
+    displacement[0] = pTo->position[0] - pFrom->position[0];
+    displacement[1] = pTo->position[1] - pFrom->position[1];
+    displacement[2] = pTo->position[2] - pFrom->position[2];
+    return displacement[0]*displacement[0] + displacement[1]*displacement[1] + displacement[2]*displacement[2];
+}
+
+// detach every recorded pair that has been pulled further apart than
+// either cell's detachment distance; each pair is checked exactly once
+void detach_stretched_pairs( void )
+{
+    static std::vector<Attached_Pair> pairs;
+    pairs.clear();
+    
+    for( int t=0; t < attached_pairs_by_thread.size(); t++ )
+    {
+        std::vector<Attached_Pair>& buffer = attached_pairs_by_thread[t];
+        pairs.insert( pairs.end(), buffer.begin(), buffer.end() );
+        buffer.clear();
+    }
+    
+    #pragma omp parallel for
+    for( int i=0; i < pairs.size(); i++ )
+    {
+        Cell* pAttacker = pairs[i].pAttacker;
+        Cell* pTarget = pairs[i].pTarget;
+        
+        double max_displacement_squared = std::min( contact_parameters[ pAttacker->type ].max_displacement_squared ,
+            contact_parameters[ pTarget->type ].max_displacement_squared );
+        
+        double displacement[3];
+        if( attached_displacement( pAttacker, pTarget, displacement ) > max_displacement_squared )
+        { request_detachment( pAttacker, pTarget ); }
+    }
+    
+    return;
+}
+
+void resolve_attachment_requests( void )
+{
+    CANCER_IMMUNE_TIMED_SCOPE( timed_resolve_attachments );
+    
+    detach_stretched_pairs();
+    
+    static std::vector<Attachment_Request> requests;
+    requests.clear();
+    
+    for( int t=0; t < attachment_requests_by_thread.size(); t++ )
+    {
+        std::vector<Attachment_Request>& buffer = attachment_requests_by_thread[t];
+        requests.insert( requests.end(), buffer.begin(), buffer.end() );
+        buffer.clear();
+    }
+    
+    // the order requests were recorded in depends on thread scheduling;
+    // sorting makes the outcome independent of it
+    std::sort( requests.begin(), requests.end(), attachment_request_order );
+    
+    for( int i=0; i < requests.size(); i++ )
+    {
+        Attachment_Request& request = requests[i];
+        
+        // skip duplicates
+        if( i > 0 && request.kind == requests[i-1].kind &&
+            request.pAttacker == requests[i-1].pAttacker && request.pTarget == requests[i-1].pTarget )
+        { continue; }
+        
+        // the first attacker (by ID) kills the target; the others find
+        // it dead and are only detached, by their own detach requests
+        if( request.kind == kill_request )
+        {
+            if( request.pTarget->phenotype.death.dead == false )
+            { request.pTarget->start_death( cancer_immune_indices.apoptosis ); }
+            continue;
+        }
+        
+        if( request.kind == detach_request )
+        {
+            remove_attached_cell( request.pAttacker, request.pTarget );
+            remove_attached_cell( request.pTarget, request.pAttacker );
+            continue;
+        }
+        
+        // an attacker docks to one target at a time, and never to a cell
+        // that died earlier in this step. Several attackers may still dock
+        // to the same target; they are applied in attacker ID order.
+        if( request.pAttacker->phenotype.death.dead || request.pTarget->phenotype.death.dead )
+        { continue; }
+        if( request.pAttacker->state.attached_cells.size() > 0 )
+        { continue; }
+        
+        add_attached_cell( request.pAttacker, request.pTarget );
+        add_attached_cell( request.pTarget, request.pAttacker );
+        
+        if( docking_events_scheduled )
+        { schedule_docking_events( request.pAttacker, request.pTarget ); }
     }
     
     return;
 }
-*/
 
 void immune_cell_motility( Cell* pCell, Phenotype& phenotype, double dt )
 {
+    CANCER_IMMUNE_TIMED_SCOPE( timed_immune_cell_motility );
+    
     // if attached, biased motility towards director chemoattractant
     // otherwise, biased motility towards cargo chemoattractant
     
-    static int immune_factor_index = microenvironment.find_density_index( "immunostimulatory factor" );
+    int immune_factor_index = cancer_immune_indices.immunostimulatory_factor;
 
     // if not docked, attempt biased chemotaxis
     if( pCell->state.attached_cells.size() == 0 )
     {
         phenotype.motility.is_motile = true;
         
-        phenotype.motility.migration_bias_direction = pCell->nearest_gradient(immune_factor_index);
+        cached_nearest_gradient( pCell, immune_factor_index, phenotype.motility.migration_bias_direction.data() );
         normalize( &( phenotype.motility.migration_bias_direction ) );
     }
     else
@@ -683,45 +2141,35 @@ void immune_cell_motility( Cell* pCell, Phenotype& phenotype, double dt )
 
 Cell* immune_cell_check_neighbors_for_attachment( Cell* pAttacker , double dt )
 {
-    std::vector<Cell*> nearby = pAttacker->cells_in_my_container();
-    int i = 0;
-    while( i < nearby.size() )
-    {
-        // don't try to kill yourself
-        if( nearby[i] != pAttacker )
-        {
-            if( immune_cell_attempt_attachment( pAttacker, nearby[i] , dt ) )
-            { return nearby[i]; }
-        }
-        i++;
-    }
-    
-    return NULL;
+    // scan my voxel and the neighboring voxels in place; find_nearby_cell
+    // already skips the attacker, so we don't try to kill ourselves
+    return find_nearby_cell( pAttacker ,
+        [pAttacker,dt]( Cell* pTarget )
+        { return immune_cell_attempt_attachment( pAttacker, pTarget , dt ); } );
 }
 
 bool immune_cell_attempt_attachment( Cell* pAttacker, Cell* pTarget , double dt )
 {
-    static int oncoprotein_i = pTarget->custom_data.find_variable_index( "oncoprotein" );
-    static int attach_rate_i = pAttacker->custom_data.find_variable_index( "attachment_rate" );
+    int oncoprotein_i = cancer_immune_indices.oncoprotein;
+    int attach_rate_i = cancer_immune_indices.attachment_rate;
 
-    double oncoprotein_saturation =
-        pAttacker->custom_data["oncoprotein_saturation"];
-    double oncoprotein_threshold =
-        pAttacker->custom_data["oncoprotein_threshold"];
-    double oncoprotein_difference = oncoprotein_saturation - oncoprotein_threshold;
+    const Immune_Attack_Parameters& params = immune_attack_parameters[ pAttacker->type ];
+    double oncoprotein_threshold = params.oncoprotein_threshold;
+    double oncoprotein_difference = params.oncoprotein_difference;
     
-    double max_attachment_distance =
-        pAttacker->custom_data["max_attachment_distance"];
-    double min_attachment_distance =
-        pAttacker->custom_data["min_attachment_distance"];
-    double attachment_difference = max_attachment_distance - min_attachment_distance;
+    double max_attachment_distance = params.max_attachment_distance;
+    double attachment_difference = params.attachment_difference;
     
     if( pTarget->custom_data[oncoprotein_i] > oncoprotein_threshold && pTarget->phenotype.death.dead == false )
     {
-        std::vector<double> displacement = pTarget->position - pAttacker->position;
-        double distance_scale = norm( displacement );
-        if( distance_scale > max_attachment_distance )
+        // compare squared distances; only an eligible target needs the root
+        double dx = pTarget->position[0] - pAttacker->position[0];
+        double dy = pTarget->position[1] - pAttacker->position[1];
+        double dz = pTarget->position[2] - pAttacker->position[2];
+        double distance_squared = dx*dx + dy*dy + dz*dz;
+        if( distance_squared > max_attachment_distance * max_attachment_distance )
         { return false; }
+        double distance_scale = sqrt( distance_squared );
     
         double scale = pTarget->custom_data[oncoprotein_i];
         scale -= oncoprotein_threshold;
@@ -735,10 +2183,10 @@ bool immune_cell_attempt_attachment( Cell* pAttacker, Cell* pTarget , double dt
         if( distance_scale > 1.0 )
         { distance_scale = 1.0; }
         
-        if( UniformRandom() < pAttacker->custom_data[attach_rate_i] * scale * dt * distance_scale )
+        if( cell_uniform_random( pAttacker, random_event_attachment ) < pAttacker->custom_data[attach_rate_i] * scale * dt * distance_scale )
         {
 //            std::cout << "\t attach!" << " " << pTarget->custom_data[oncoprotein_i] << std::endl;
-            attach_cells( pAttacker, pTarget );
+            request_attachment( pAttacker, pTarget );
         }
         
         return true;
@@ -749,15 +2197,12 @@ bool immune_cell_attempt_attachment( Cell* pAttacker, Cell* pTarget , double dt
 
 bool immune_cell_attempt_apoptosis( Cell* pAttacker, Cell* pTarget, double dt )
 {
-    static int oncoprotein_i = pTarget->custom_data.find_variable_index( "oncoprotein" );
-    static int apoptosis_model_index = pTarget->phenotype.death.find_death_model_index( "apoptosis" );
-    static int kill_rate_index = pAttacker->custom_data.find_variable_index( "kill_rate" );
+    int oncoprotein_i = cancer_immune_indices.oncoprotein;
+    int kill_rate_index = cancer_immune_indices.kill_rate;
     
-    double oncoprotein_saturation =
-        pAttacker->custom_data["oncoprotein_saturation"]; // 2.0;
-    double oncoprotein_threshold =
-        pAttacker->custom_data["oncoprotein_threshold"]; // 0.5; // 0.1;
-    double oncoprotein_difference = oncoprotein_saturation - oncoprotein_threshold;
+    const Immune_Attack_Parameters& params = immune_attack_parameters[ pAttacker->type ];
+    double oncoprotein_threshold = params.oncoprotein_threshold; // 0.5; // 0.1;
+    double oncoprotein_difference = params.oncoprotein_difference;
 
     // new
     if( pTarget->custom_data[oncoprotein_i] < oncoprotein_threshold )
@@ -771,7 +2216,7 @@ bool immune_cell_attempt_apoptosis( Cell* pAttacker, Cell* pTarget, double dt )
     { scale = 1.0; }
     
     // if numerical conditions are met and tumor cell is not PDL1+
-    if( (UniformRandom() < pAttacker->custom_data[kill_rate_index] * scale * dt) && (pTarget->custom_data["PDL1"] == 1)) // PDL1 value is either 0 if survived, or 1. So T cell can attach to PDL1+ cells but won't be able to kill them.
+    if( (cell_uniform_random( pAttacker, random_event_apoptosis ) < pAttacker->custom_data[kill_rate_index] * scale * dt) && (pTarget->custom_data[cancer_immune_indices.PDL1] == 1)) // PDL1 value is either 0 if survived, or 1. So T cell can attach to PDL1+ cells but won't be able to kill them.
     {
 //        std::cout << "\t\t kill!" << " " << pTarget->custom_data[oncoprotein_i] << std::endl;
         return true;
@@ -779,21 +2224,92 @@ bool immune_cell_attempt_apoptosis( Cell* pAttacker, Cell* pTarget, double dt )
     return false;
 }
 
-bool immune_cell_trigger_apoptosis( Cell* pAttacker, Cell* pTarget )
+bool docking_events_scheduled = true;
+
+// exponential waiting time from now, or never for a zero rate
+double sample_event_time( Cell* pCell, int event, double rate )
+{
+    if( rate <= 0.0 )
+    { return 9e99; }
+    return PhysiCell_globals.current_time - log( cell_uniform_random( pCell, event ) ) / rate;
+}
+
+void schedule_docking_events( Cell* pAttacker, Cell* pTarget )
+{
+    int oncoprotein_i = cancer_immune_indices.oncoprotein;
+    const Immune_Attack_Parameters& params = immune_attack_parameters[ pAttacker->type ];
+    
+    // same hazard as immune_cell_attempt_apoptosis, fixed for the pair
+    double kill_rate = 0.0;
+    if( pTarget->custom_data[oncoprotein_i] >= params.oncoprotein_threshold )
+    {
+        double scale = pTarget->custom_data[oncoprotein_i];
+        scale -= params.oncoprotein_threshold;
+        scale /= params.oncoprotein_difference;
+        if( scale > 1.0 )
+        { scale = 1.0; }
+        kill_rate = pAttacker->custom_data[ cancer_immune_indices.kill_rate ] * scale;
+    }
+    
+    double detach_rate = 1.0 / ( pAttacker->custom_data[ cancer_immune_indices.attachment_lifetime ] + 1e-15 );
+    
+    pAttacker->custom_data[ cancer_immune_indices.docking_kill_time ] = sample_event_time( pAttacker, random_event_docking_kill, kill_rate );
+    pAttacker->custom_data[ cancer_immune_indices.docking_detach_time ] = sample_event_time( pAttacker, random_event_docking_detach, detach_rate );
+    
+    return;
+}
+
+void immune_cell_docked_events( Cell* pCell, Phenotype& phenotype )
 {
-    static int apoptosis_model_index = pTarget->phenotype.death.find_death_model_index( "apoptosis" );
+    int kill_time_i = cancer_immune_indices.docking_kill_time;
+    double now = PhysiCell_globals.current_time;
+    Cell* pTarget = pCell->state.attached_cells[0];
+    
+    bool detach_me = false;
+    
+    // the kill fires once. A PD-L1+ target (PDL1 == 0, which is never
+    // undone) survives it, as in immune_cell_attempt_apoptosis
+    if( now >= pCell->custom_data[kill_time_i] )
+    {
+        pCell->custom_data[kill_time_i] = 9e99;
+        if( pTarget->custom_data[cancer_immune_indices.PDL1] == 1 )
+        {
+            immune_cell_trigger_apoptosis( pCell, pTarget );
+            detach_me = true;
+        }
+    }
+    
+    if( now >= pCell->custom_data[ cancer_immune_indices.docking_detach_time ] )
+    { detach_me = true; }
+    
+    if( detach_me )
+    {
+        request_detachment( pCell, pTarget );
+        phenotype.motility.is_motile = true;
+    }
+    else
+    { record_attached_pair( pCell, pTarget ); }
     
+    return;
+}
+
+bool immune_cell_trigger_apoptosis( Cell* pAttacker, Cell* pTarget )
+{
     // if the Target cell is already dead, don't bother!
     if( pTarget->phenotype.death.dead == true )
     { return false; }
-
-    pTarget->start_death( apoptosis_model_index );
+    
+    // the target may be shared with other attackers in this step, so
+    // the kill is applied later, in resolve_attachment_requests
+    request_kill( pAttacker, pTarget );
     return true;
 }
 
 void immune_cell_rule( Cell* pCell, Phenotype& phenotype, double dt )
 {
-    static int attach_lifetime_i = pCell->custom_data.find_variable_index( "attachment_lifetime" );
+    CANCER_IMMUNE_TIMED_SCOPE( timed_immune_cell_rule );
+    
+    int attach_lifetime_i = cancer_immune_indices.attachment_lifetime;
     
     if( phenotype.death.dead == true )
     {
@@ -802,10 +2318,23 @@ void immune_cell_rule( Cell* pCell, Phenotype& phenotype, double dt )
         
         // Let's just fully disable now.
         pCell->functions.custom_cell_rule = NULL;
+        record_cell_death( pCell );
+        
+        // this rule won't run again to record the pair, so let go of my
+        // target now rather than leave it holding a dead cell
+        for( int i=0; i < pCell->state.attached_cells.size(); i++ )
+        { request_detachment( pCell, pCell->state.attached_cells[i] ); }
         return;
     }
     
+    add_to_spatial_extent( pCell );
+    
     // if I'm docked
+    if( pCell->state.number_of_attached_cells() > 0 && docking_events_scheduled )
+    {
+        immune_cell_docked_events( pCell, phenotype );
+        return;
+    }
     if( pCell->state.number_of_attached_cells() > 0 )
     {
         // attempt to kill my attached cell
@@ -820,16 +2349,18 @@ void immune_cell_rule( Cell* pCell, Phenotype& phenotype, double dt )
         
         // decide whether to detach
         
-        if( UniformRandom() < dt / ( pCell->custom_data[attach_lifetime_i] + 1e-15 ) )
+        if( cell_uniform_random( pCell, random_event_detachment ) < dt / ( pCell->custom_data[attach_lifetime_i] + 1e-15 ) )
         { detach_me = true; }
         
         // if I dettach, resume motile behavior
         
         if( detach_me )
         {
-            detach_cells( pCell, pCell->state.attached_cells[0] );
+            request_detachment( pCell, pCell->state.attached_cells[0] );
             phenotype.motility.is_motile = true;
         }
+        else
+        { record_attached_pair( pCell, pCell->state.attached_cells[0] ); }
         return;
     }
     
@@ -849,20 +2380,20 @@ void immune_cell_rule( Cell* pCell, Phenotype& phenotype, double dt )
 
 void adhesion_contact_function( Cell* pActingOn, Phenotype& pao, Cell* pAttachedTo, Phenotype& pat , double dt )
 {
-    std::vector<double> displacement = pAttachedTo->position - pActingOn->position;
+    CANCER_IMMUNE_TIMED_SCOPE( timed_adhesion_contact );
     
-    static double max_elastic_displacement = pao.geometry.radius * pao.mechanics.relative_detachment_distance;
-    static double max_displacement_squared = max_elastic_displacement*max_elastic_displacement;
+    const Contact_Parameters& contact = contact_parameters[ pActingOn->type ];
     
-    // detach cells if too far apart
+    double displacement[3];
+    double distance_squared = attached_displacement( pActingOn, pAttachedTo, displacement );
     
-    if( norm_squared( displacement ) > max_displacement_squared )
-    {
-        detach_cells( pActingOn , pAttachedTo );
-        return;
-    }
+    // too far apart: no pull, and detach_stretched_pairs() will separate them
+    if( distance_squared > contact.max_displacement_squared )
+    { return; }
     
-    axpy( &(pActingOn->velocity) , pao.mechanics.attachment_elastic_constant , displacement );
+    pActingOn->velocity[0] += contact.elastic_constant * displacement[0];
+    pActingOn->velocity[1] += contact.elastic_constant * displacement[1];
+    pActingOn->velocity[2] += contact.elastic_constant * displacement[2];
     
     return;
 }
@@ -909,52 +2440,376 @@ std::vector<std::string> cancer_cell_PDL1_coloring_function( Cell* pCell)
     return output;
 }
 */
+// deaths per time bin. Bin b (counted from t = 0) lives in slot b % size.
+std::vector<int> death_ledger_bins;
+double death_ledger_bin_width = 1.0;
+long long death_ledger_newest_bin = 0;
+int death_ledger_total = 0;
+// bins of deaths recorded during the parallel update, one buffer per thread
+std::vector< std::vector<long long> > death_ledger_pending;
+
+void initialize_death_ledger( void )
+{
+    double window = parameters.doubles("dead_cell_time_window");
+    death_ledger_bin_width = parameters.doubles("dead_cell_ledger_bin_width");
+    
+    int number_of_bins = (int) ceil( window / death_ledger_bin_width - 1e-9 );
+    if( number_of_bins < 1 )
+    { number_of_bins = 1; }
+    
+    death_ledger_bins.assign( number_of_bins , 0 );
+    death_ledger_newest_bin = 0;
+    death_ledger_total = 0;
+    death_ledger_pending.assign( omp_get_max_threads() , std::vector<long long>() );
+    
+    return;
+}
+
+void record_cell_death( Cell* pCell )
+{
+    double& recorded = pCell->custom_data[ cancer_immune_indices.death_recorded ];
+    if( recorded != 0.0 )
+    { return; }
+    recorded = 1.0;
+    
+    long long bin = (long long) floor( PhysiCell_globals.current_time / death_ledger_bin_width );
+    death_ledger_pending[ omp_get_thread_num() ].push_back( bin );
+    return;
+}
+
+void update_death_ledger( double current_time )
+{
+    long long number_of_bins = death_ledger_bins.size();
+    long long bin = (long long) floor( current_time / death_ledger_bin_width );
+    
+    // advance the ring, dropping bins that fall out of the window
+    if( bin - death_ledger_newest_bin >= number_of_bins )
+    {
+        std::fill( death_ledger_bins.begin(), death_ledger_bins.end(), 0 );
+        death_ledger_total = 0;
+        death_ledger_newest_bin = bin;
+    }
+    while( death_ledger_newest_bin < bin )
+    {
+        death_ledger_newest_bin++;
+        int& count = death_ledger_bins[ death_ledger_newest_bin % number_of_bins ];
+        death_ledger_total -= count;
+        count = 0;
+    }
+    
+    // fold in the deaths recorded since the last update
+    for( int t=0; t < death_ledger_pending.size(); t++ )
+    {
+        std::vector<long long>& pending = death_ledger_pending[t];
+        for( int i=0; i < pending.size(); i++ )
+        {
+            if( pending[i] > death_ledger_newest_bin - number_of_bins && pending[i] <= death_ledger_newest_bin )
+            {
+                death_ledger_bins[ pending[i] % number_of_bins ]++;
+                death_ledger_total++;
+            }
+        }
+        pending.clear();
+    }
+    
+    return;
+}
+
 int sum_dead_cells_over_time_window ()
 {
-    static int dead_cell_counter = 0;
-    Cell* pCell = NULL;
-    // loop over all cells
-    for ( int i=0; i < (*all_cells).size(); i++ )
+    update_death_ledger( PhysiCell_globals.current_time );
+    return death_ledger_total;
+}
+
+// per-thread accumulators [thread][type], and the combined extent per type
+std::vector< std::vector<Spatial_Extent> > spatial_extents_by_thread;
+std::vector<Spatial_Extent> combined_spatial_extents;
+int number_of_extent_sectors = 0;
+
+void reset_spatial_extent( Spatial_Extent& extent, double time )
+{
+    extent.time = time;
+    extent.count = 0;
+    extent.max_radius_squared = 0.0;
+    extent.position_sum.assign( 3 , 0.0 );
+    extent.max_radius_squared_by_sector.assign( number_of_extent_sectors , 0.0 );
+    return;
+}
+
+void initialize_spatial_extents( void )
+{
+    number_of_extent_sectors = parameters.ints("extent_angular_sectors");
+    if( number_of_extent_sectors < 0 )
+    { number_of_extent_sectors = 0; }
+    
+    int number_of_types = immune_attack_parameters.size();
+    
+    Spatial_Extent empty;
+    reset_spatial_extent( empty , -9e9 );
+    
+    spatial_extents_by_thread.assign( omp_get_max_threads() , std::vector<Spatial_Extent>( number_of_types , empty ) );
+    combined_spatial_extents.assign( number_of_types , empty );
+    
+    return;
+}
+
+void add_to_spatial_extent( Cell* pCell )
+{
+    Spatial_Extent& extent = spatial_extents_by_thread[ omp_get_thread_num() ][ pCell->type ];
+    
+    // first contribution of a new pass
+    if( extent.time != PhysiCell_globals.current_time )
+    { reset_spatial_extent( extent , PhysiCell_globals.current_time ); }
+    
+    std::vector<double>& position = pCell->position;
+    double r2 = position[0]*position[0] + position[1]*position[1] + position[2]*position[2];
+    
+    extent.count++;
+    extent.position_sum[0] += position[0];
+    extent.position_sum[1] += position[1];
+    extent.position_sum[2] += position[2];
+    if( r2 > extent.max_radius_squared )
+    { extent.max_radius_squared = r2; }
+    
+    if( number_of_extent_sectors > 0 )
+    {
+        // azimuthal sector, from the angle in [0,2pi]
+        double angle = atan2( position[1], position[0] ) + 3.141592653589793;
+        int sector = (int) floor( angle * number_of_extent_sectors / 6.283185307179586 );
+        if( sector >= number_of_extent_sectors )
+        { sector = number_of_extent_sectors-1; }
+        if( r2 > extent.max_radius_squared_by_sector[sector] )
+        { extent.max_radius_squared_by_sector[sector] = r2; }
+    }
+    
+    return;
+}
+
+const Spatial_Extent& spatial_extent( int type )
+{
+    Spatial_Extent& combined = combined_spatial_extents[type];
+    
+    // find the most recent pass that any thread contributed to
+    double latest = combined.time;
+    for( int t=0; t < spatial_extents_by_thread.size(); t++ )
+    {
+        if( spatial_extents_by_thread[t][type].time > latest )
+        { latest = spatial_extents_by_thread[t][type].time; }
+    }
+    if( latest == combined.time )
+    { return combined; }
+    
+    // threads that saw none of these cells in that pass still hold older data; skip them
+    reset_spatial_extent( combined , latest );
+    for( int t=0; t < spatial_extents_by_thread.size(); t++ )
+    {
+        Spatial_Extent& extent = spatial_extents_by_thread[t][type];
+        if( extent.time != latest )
+        { continue; }
+        
+        combined.count += extent.count;
+        for( int i=0; i < 3; i++ )
+        { combined.position_sum[i] += extent.position_sum[i]; }
+        if( extent.max_radius_squared > combined.max_radius_squared )
+        { combined.max_radius_squared = extent.max_radius_squared; }
+        for( int n=0; n < number_of_extent_sectors; n++ )
+        {
+            if( extent.max_radius_squared_by_sector[n] > combined.max_radius_squared_by_sector[n] )
+            { combined.max_radius_squared_by_sector[n] = extent.max_radius_squared_by_sector[n]; }
+        }
+    }
+    
+    return combined;
+}
+
+double spatial_extent_radius( int type )
+{
+    return sqrt( spatial_extent( type ).max_radius_squared );
+}
+
+std::vector<double> spatial_extent_centroid( int type )
+{
+    const Spatial_Extent& extent = spatial_extent( type );
+    std::vector<double> centroid( 3 , 0.0 );
+    if( extent.count > 0 )
+    {
+        for( int i=0; i < 3; i++ )
+        { centroid[i] = extent.position_sum[i] / (double) extent.count; }
+    }
+    return centroid;
+}
+
+// counter-based random numbers: Philox4x32-10 (Salmon et al., SC 2011).
+// every draw is a pure function of (seed, event kind, stream, step, draw),
+// so results don't depend on the thread count or on scheduling order
+unsigned int counter_random_seed = 0;
+
+void initialize_counter_random( unsigned int seed )
+{
+    counter_random_seed = seed;
+    return;
+}
+
+void philox4x32( unsigned int counter[4] , unsigned int key[2] )
+{
+    for( int round=0; round < 10; round++ )
+    {
+        unsigned long long product_0 = 0xD2511F53ULL * counter[0];
+        unsigned long long product_1 = 0xCD9E8D57ULL * counter[2];
+        
+        unsigned int next[4];
+        next[0] = (unsigned int)( product_1 >> 32 ) ^ counter[1] ^ key[0];
+        next[1] = (unsigned int) product_1;
+        next[2] = (unsigned int)( product_0 >> 32 ) ^ counter[3] ^ key[1];
+        next[3] = (unsigned int) product_0;
+        
+        for( int i=0; i < 4; i++ )
+        { counter[i] = next[i]; }
+        
+        key[0] += 0x9E3779B9U;
+        key[1] += 0xBB67AE85U;
+    }
+    return;
+}
+
+// 53-bit uniform in (0,1) from two 32-bit words
+double counter_words_to_uniform( unsigned int high, unsigned int low )
+{
+    unsigned long long bits = ( (unsigned long long)( high >> 5 ) << 26 ) | ( low >> 6 );
+    return ( bits + 0.5 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+void counter_random_block( int event, unsigned long long stream, unsigned int draw, double uniforms[2] )
+{
+    long long step = counter_random_step();
+    
+    unsigned int counter[4];
+    counter[0] = (unsigned int) stream;
+    counter[1] = (unsigned int)( stream >> 32 );
+    counter[2] = (unsigned int) step;
+    counter[3] = draw;
+    
+    unsigned int key[2];
+    key[0] = counter_random_seed;
+    key[1] = (unsigned int) event ^ ( (unsigned int)( step >> 32 ) << 8 );
+    
+    philox4x32( counter , key );
+    
+    uniforms[0] = counter_words_to_uniform( counter[0] , counter[1] );
+    uniforms[1] = counter_words_to_uniform( counter[2] , counter[3] );
+    return;
+}
+
+long long counter_random_step( void )
+{
+    return (long long) floor( PhysiCell_globals.current_time / diffusion_dt + 0.5 );
+}
+
+double counter_uniform_random( int event, unsigned long long stream, unsigned int draw )
+{
+    double uniforms[2];
+    counter_random_block( event, stream, draw, uniforms );
+    return uniforms[0];
+}
+
+double counter_normal_random( int event, unsigned long long stream, unsigned int draw, double mean, double standard_deviation )
+{
+    // Box-Muller on the two uniforms of one block
+    double uniforms[2];
+    counter_random_block( event, stream, draw, uniforms );
+    double radius = sqrt( -2.0 * log( uniforms[0] ) );
+    return mean + standard_deviation * radius * cos( 6.283185307179586476925286766559 * uniforms[1] );
+}
+
+double cell_uniform_random( Cell* pCell, int event, unsigned int draw )
+{
+    return counter_uniform_random( event, (unsigned long long) pCell->ID, draw );
+}
+
+// make room for additional entries without giving up geometric growth:
+// an exact-size reserve on every small batch would copy the list each time
+void reserve_additional_cells( std::vector<Cell*>& cells, int additional )
+{
+    std::size_t needed = cells.size() + additional;
+    if( needed > cells.capacity() )
+    { cells.reserve( std::max( needed , 2*cells.capacity() ) ); }
+    return;
+}
+
+std::vector<Cell*> create_cells_at_positions( Cell_Definition& cd , const std::vector<double>& positions )
+{
+    int number_of_cells = positions.size() / 3;
+    std::vector<Cell*> cells( number_of_cells , NULL );
+    if( number_of_cells == 0 )
+    { return cells; }
+    
+    reserve_additional_cells( *all_cells , number_of_cells );
+    
+    // find the mechanics voxel of each new cell, so every voxel's agent
+    // list is grown once for all of its newcomers
+    Cell_Container* pContainer = (Cell_Container*) microenvironment.agent_container;
+    Cartesian_Mesh& mesh = pContainer->underlying_mesh;
+    int nx = mesh.x_coordinates.size();
+    int ny = mesh.y_coordinates.size();
+    int nz = mesh.z_coordinates.size();
+    
+    std::vector<int> voxels( number_of_cells , -1 );
+    
+    #pragma omp parallel for
+    for( int n=0; n < number_of_cells; n++ )
     {
-        pCell = (*all_cells)[i];
-        // if cell is dead increase counter
-        if (pCell->phenotype.death.dead == true)
+        int i = (int) floor( ( positions[3*n] - mesh.bounding_box[0] ) / mesh.dx );
+        int j = (int) floor( ( positions[3*n+1] - mesh.bounding_box[1] ) / mesh.dy );
+        int k = (int) floor( ( positions[3*n+2] - mesh.bounding_box[2] ) / mesh.dz );
+        
+        // cells outside the domain are handled by assign_position
+        if( i >= 0 && i < nx && j >= 0 && j < ny && k >= 0 && k < nz )
+        { voxels[n] = i + nx*( j + ny*k ); }
+    }
+    
+    std::vector<int> sorted_voxels = voxels;
+    std::sort( sorted_voxels.begin(), sorted_voxels.end() );
+    int start = 0;
+    while( start < number_of_cells )
+    {
+        int end = start;
+        while( end < number_of_cells && sorted_voxels[end] == sorted_voxels[start] )
+        { end++; }
+        if( sorted_voxels[start] >= 0 )
         {
-        dead_cell_counter++;
+            reserve_additional_cells( pContainer->agent_grid[ sorted_voxels[start] ] , end - start );
         }
+        start = end;
     }
-    // currently only takes the number of dead in current step, not summed over time window
-    // FIX
-    //static int num_deaths_current_step = Cell_container->num_deaths_in_current_step;
-    return dead_cell_counter;
     
+    // create_cell() and registration with the container are not thread safe
+    for( int n=0; n < number_of_cells; n++ )
+    {
+        cells[n] = create_cell( cd );
+        cells[n]->assign_position( positions[3*n] , positions[3*n+1] , positions[3*n+2] );
+    }
+    
+    return cells;
 }
 
 // recruit number of T cells based on function provided by Gong et al Cess et al models
 void recruit_T_cells ()
 {
+    CANCER_IMMUNE_TIMED_BATCH( timed_recruit_T_cells );
+    
     Cell_Definition* pCell = find_cell_definition( "cancer cell" );
 
     // retrieve ka (mutational burden) and ki (neoantigen strength)
-    static double ka = pCell->custom_data["mutational_burden"];
-    static double ki = pCell->custom_data["neoantigen_strength"];
-    static double r1 = pCell->custom_data["r1"];
+    static double ka = pCell->custom_data[cancer_immune_indices.mutational_burden];
+    static double ki = pCell->custom_data[cancer_immune_indices.neoantigen_strength];
+    static double r1 = pCell->custom_data[cancer_immune_indices.r1];
     
     // calculate rate of tumor recruitment
-    double T_cell_recruit_rate = ka*(double)sum_dead_cells_over_time_window()*r1/((1/ki)+(double)sum_dead_cells_over_time_window());
-
-    double tumor_radius = -9e9; // 250.0;
-    double temp_radius = 0.0;
+    double dead_cells = (double) sum_dead_cells_over_time_window();
+    double T_cell_recruit_rate = ka*dead_cells*r1/((1/ki)+dead_cells);
     
-    // for the loop, deal with the (faster) norm squared and ONLY tumor cells
-    for( int i=0; i < (*all_cells).size() && (*all_cells)[i]->type == 0; i++ )
-    {
-        temp_radius = norm_squared( (*all_cells)[i]->position );
-        if( temp_radius > tumor_radius )
-        { tumor_radius = temp_radius; }
-    }
-    // now square root to get to radius
-    tumor_radius = sqrt( tumor_radius );
+    // farthest live tumor cell as of the last phenotype update
+    double tumor_radius = spatial_extent_radius( cell_defaults.type );
     
     // if this goes wackadoodle, choose 250
     if( tumor_radius < 250.0 )
@@ -977,16 +2832,28 @@ void recruit_T_cells ()
     double mean_radius = 0.5*(radius_inner + radius_outer);
     double std_radius = 0.33*( radius_outer-radius_inner)/2.0;
     
+    if( number_of_immune_cells <= 0 )
+    { return; }
+    
+    // draw all positions in parallel, then create the cells in one batch
+    CANCER_IMMUNE_TIMED_ITEMS( timed_recruit_T_cells , number_of_immune_cells );
+    std::vector<double> positions( 3*number_of_immune_cells , 0.0 );
+    
+    #pragma omp parallel for
     for( int i=0 ;i < number_of_immune_cells ; i++ )
     {
-        double theta = UniformRandom() * 6.283185307179586476925286766559;
-        double phi = acos( 2.0*UniformRandom() - 1.0 );
+        // stream i of this step's recruitment: the same positions at any thread count
+        double theta = counter_uniform_random( random_event_recruitment, i, 0 ) * 6.283185307179586476925286766559;
+        double phi = acos( 2.0*counter_uniform_random( random_event_recruitment, i, 1 ) - 1.0 );
         
-        double radius = NormalRandom( mean_radius, std_radius );
+        double radius = counter_normal_random( random_event_recruitment, i, 2, mean_radius, std_radius );
         
-        Cell* pCell = create_cell( *pImmuneCell );
-        pCell->assign_position( radius*cos(theta)*sin(phi), radius*sin(theta)*sin(phi), radius*cos(phi) );
+        positions[3*i] = radius*cos(theta)*sin(phi);
+        positions[3*i+1] = radius*sin(theta)*sin(phi);
+        positions[3*i+2] = radius*cos(phi);
     }
+    
+    create_cells_at_positions( *pImmuneCell , positions );
     return;
 }
 
@@ -994,6 +2861,17 @@ void recruit_T_cells ()
 // macrophage functions
 void macrophage_rule( Cell* pCell, Phenotype& phenotype, double dt )
 {
+    CANCER_IMMUNE_TIMED_SCOPE( timed_macrophage_rule );
+    
+    if( phenotype.death.dead == true )
+    {
+        pCell->functions.update_phenotype = NULL;
+        record_cell_death( pCell );
+        return;
+    }
+    
+    add_to_spatial_extent( pCell );
+    
     ///////////////////////////////
     /*
     static int IL4_ID = microenvironment.find_density_index( "IL4" );
@@ -1029,7 +2907,7 @@ void macrophage_rule( Cell* pCell, Phenotype& phenotype, double dt )
     if (pCell -> custom_data["macrophage_identity"] == 2)
     {
         // secrete IL-4
-        phenotype.secretion.secretion_rates[IL4_ID] = 10;
+        set_secretion_rate( phenotype, IL4_ID, 10 );
         // dampen immune-attack
         
     }
@@ -1045,8 +2923,87 @@ void macrophage_motility( Cell* pCell, Phenotype& phenotype, double dt )
     
     /*
     // follow IL4 gradient, implement later
-    phenotype.motility.migration_bias_direction = pCell->nearest_gradient(IL4_index);
+    cached_nearest_gradient( pCell, IL4_index, phenotype.motility.migration_bias_direction.data() );
     normalize( &( phenotype.motility.migration_bias_direction ) );
     */
     return;
 }
+
+const char* timed_section_names[number_of_timed_sections] =
+{
+    "tumor_cell_phenotype",
+    "immune_cell_rule",
+    "immune_cell_motility",
+    "adhesion_contact_function",
+    "macrophage_rule",
+    "recruit_T_cells",
+    "diffusion",
+    "resolve_attachment_requests",
+    "output",
+    "update_all_cells"
+};
+
+// [thread][section]
+std::vector< std::vector<Section_Timing> > section_timing_by_thread;
+
+void initialize_section_timing( void )
+{
+#ifdef CANCER_IMMUNE_TIMING
+    Section_Timing empty = { 0 , 0 , 0.0 };
+    section_timing_by_thread.assign( omp_get_max_threads() , std::vector<Section_Timing>( number_of_timed_sections , empty ) );
+    
+    std::ofstream csv( ( PhysiCell_settings.folder + "/timing.csv" ).c_str() );
+    csv << "time,section,calls,items,total_seconds,mean_seconds" << std::endl;
+#endif
+    return;
+}
+
+#ifdef CANCER_IMMUNE_TIMING
+
+Scoped_Timer::Scoped_Timer( int section, long long items ) :
+    section( section ), items( items ), start( std::chrono::steady_clock::now() )
+{}
+
+Scoped_Timer::~Scoped_Timer()
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    Section_Timing& timing = section_timing_by_thread[ omp_get_thread_num() ][ section ];
+    timing.calls++;
+    timing.items += items;
+    timing.seconds += elapsed.count();
+}
+
+void add_timed_items( int section, long long items )
+{
+    section_timing_by_thread[ omp_get_thread_num() ][ section ].items += items;
+    return;
+}
+
+#endif
+
+void write_section_timing( double time )
+{
+#ifdef CANCER_IMMUNE_TIMING
+    std::ofstream csv( ( PhysiCell_settings.folder + "/timing.csv" ).c_str() , std::ios::app );
+    
+    for( int section=0; section < number_of_timed_sections; section++ )
+    {
+        Section_Timing total = { 0 , 0 , 0.0 };
+        for( int t=0; t < section_timing_by_thread.size(); t++ )
+        {
+            Section_Timing& timing = section_timing_by_thread[t][section];
+            total.calls += timing.calls;
+            total.items += timing.items;
+            total.seconds += timing.seconds;
+            
+            timing.calls = 0;
+            timing.items = 0;
+            timing.seconds = 0.0;
+        }
+        
+        csv << time << "," << timed_section_names[section] << "," << total.calls << "," << total.items << ","
+            << total.seconds << "," << total.seconds / ( total.calls + 1e-15 ) << std::endl;
+    }
+#endif
+    return;
+}
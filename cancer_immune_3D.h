@@ -68,9 +68,80 @@
 #include "../core/PhysiCell.h"
 #include "../modules/PhysiCell_standard_modules.h" 
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <atomic>
+
 using namespace BioFVM; 
 using namespace PhysiCell;
 
+// indices into custom_data, the substrates, and the death models used by
+// the rules below. These are resolved once in create_cell_types() so the
+// hot paths never hash or compare names.
+struct Cancer_Immune_Indices
+{
+    // custom_data
+    int oncoprotein;
+    int elastic_coefficient;
+    int kill_rate;
+    int attachment_lifetime;
+    int attachment_rate;
+    int oncoprotein_saturation;
+    int oncoprotein_threshold;
+    int max_attachment_distance;
+    int min_attachment_distance;
+    int PDL1;
+    int mutational_burden;
+    int neoantigen_strength;
+    int r1;
+    int docking_kill_time;
+    int docking_detach_time;
+    int death_recorded;
+    
+    // substrates
+    int oxygen;
+    int immunostimulatory_factor;
+    int IL4;
+    int IFNg;
+    
+    // death models
+    int apoptosis;
+};
+
+extern Cancer_Immune_Indices cancer_immune_indices;
+
+// attack constants that are fixed for a cell definition, so attackers
+// don't re-read them from their own custom_data on every attempt
+struct Immune_Attack_Parameters
+{
+    double oncoprotein_saturation;
+    double oncoprotein_threshold;
+    double oncoprotein_difference; // saturation - threshold
+    
+    double max_attachment_distance;
+    double min_attachment_distance;
+    double attachment_difference; // max - min
+};
+
+// indexed by cell type
+extern std::vector<Immune_Attack_Parameters> immune_attack_parameters;
+
+// elastic attachment constants, from each definition's phenotype
+struct Contact_Parameters
+{
+    double max_displacement_squared; // (radius * relative_detachment_distance)^2
+    double elastic_constant;
+};
+
+// indexed by cell type
+extern std::vector<Contact_Parameters> contact_parameters;
+
+void resolve_cancer_immune_indices( void );
+void cache_cell_type_parameters( void );
+
 // custom cell phenotype function to scale immunostimulatory factor with hypoxia 
 void tumor_cell_phenotype_with_and_immune_stimulation( Cell* pCell, Phenotype& phenotype, double dt ); 
 
@@ -85,13 +156,182 @@ void create_cell_types( void );
 
 void setup_tissue(); 
 
+// close-packed lattice points inside a sphere centered at the origin, as
+// x,y,z triples in one flat buffer (three values per cell)
+std::vector<double> create_cell_sphere_positions( double cell_radius, double sphere_radius );
+
+// count, mean, variance (Welford), min and max in one pass; per-thread
+// partial summaries are combined with merge()
+struct Running_Summary
+{
+    long long count;
+    double mean;
+    double M2; // sum of squared deviations from the mean
+    double min;
+    double max;
+    
+    Running_Summary();
+    void add( double value );
+    void merge( const Running_Summary& other );
+    double standard_deviation( void ) const;
+};
+
+// summary and histogram as CSV; the last bin counts values >= histogram_max
+void write_histogram( std::string filename, const Running_Summary& summary, const std::vector<long long>& histogram, double histogram_max );
+
 void introduce_immune_cells( void ); 
 
 // set up the microenvironment to include the immunostimulatory factor 
 void setup_microenvironment( void );   
 
+int expected_initial_cell_count( void );
+// the run's cell container (mechanics_voxel_size in mymodel.xml), built once
+// after create_cell_types(); use in place of creating one in main()
+Cell_Container* create_cancer_immune_context( void );
+
+// per-substrate LOD diffusion solver; zero substrates with no sources are
+// skipped, so turn secretion on with set_secretion_rate() or activate_substrate()
+void initialize_substrate_activity( void );
+void activate_substrates_secreted_by_definitions( void );
+void activate_substrate( int substrate_index );
+bool substrate_is_active( int substrate_index );
+void set_secretion_rate( Phenotype& phenotype, int substrate_index, double rate );
+// also applies the attachment requests recorded by the last cell update
+void cancer_immune_diffusion_solver( Microenvironment& M, double dt );
+
+// substrates listed in quasi_steady_substrates (mymodel.xml) are not
+// stepped in time; they hold the steady reaction-diffusion solution for
+// the current cell uptake and secretion, re-solved by warm-started
+// conjugate gradients once per phenotype step or when the total uptake
+// moves by more than quasi_steady_uptake_tolerance
+struct Quasi_Steady_State
+{
+    bool enabled;
+    bool solved;
+    double total_uptake_at_solve;
+    std::vector<double> field;
+    std::vector<double> uptake; // per voxel, 1/min
+    std::vector<double> source; // per voxel, substrate/min
+    
+    // solver workspace, kept between solves
+    std::vector<char> fixed; // Dirichlet voxels
+    std::vector<double> diagonal;
+    std::vector<double> rhs;
+    std::vector<double> r;
+    std::vector<double> z;
+    std::vector<double> p;
+    std::vector<double> Ap;
+    
+    Quasi_Steady_State() : enabled(false), solved(false), total_uptake_at_solve(0.0) {}
+};
+
+void initialize_quasi_steady_substrates( void );
+bool substrate_is_quasi_steady( int substrate_index );
+
+// gradients are computed per voxel on first use after each solver step
+// and cached until the next one; use this instead of nearest_gradient(),
+// with calculate_gradients off in mymodel.xml. Writes into gradient[0..2],
+// e.g. phenotype.motility.migration_bias_direction.data()
+void initialize_cached_gradients( void );
+void cached_nearest_gradient( Cell* pCell, int substrate_index, double gradient[3] );
+
+// precomputed cell color palette. Entries hold packed 0xRRGGBBAA values
+// and the matching SVG color strings. The first 256 entries shade live
+// tumor cells by quantized oncoprotein, the next 256 are the same shades
+// at half intensity for their nuclei, and the named colors follow.
+enum Cancer_Immune_Color
+{
+    color_oncoprotein_shade = 0,
+    color_oncoprotein_nucleus = 256,
+    color_black = 512,
+    color_lime,
+    color_green,
+    color_gold,
+    color_darkcyan,
+    color_cyan,
+    color_hotpink,
+    color_apoptotic,
+    color_apoptotic_nucleus,
+    color_necrotic,
+    color_necrotic_nucleus,
+    number_of_cancer_immune_colors
+};
+
+// palette indices for cytoplasm, cytoplasm outline, nucleus, nucleus outline
+struct Cell_Color_IDs
+{
+    unsigned short cytoplasm;
+    unsigned short cytoplasm_outline;
+    unsigned short nucleus;
+    unsigned short nucleus_outline;
+};
+
+void build_cancer_immune_palette( void );
+Cell_Color_IDs cancer_immune_color_ids( Cell* pCell );
+unsigned int cancer_immune_color_rgba( unsigned short color_id );
+const std::string& cancer_immune_color_string( unsigned short color_id );
+
+// SVG_plot coloring function, built on cancer_immune_color_ids()
 std::vector<std::string> cancer_immune_coloring_function( Cell* );
 
+// asynchronous snapshot output. queue_cell_snapshot() copies the fields
+// needed for output into a compact buffer and hands it to a background
+// writer thread, which writes <base>.csv and an SVG cross-section through
+// z = 0 (<base>.svg) while the simulation continues. There are two
+// buffers: if both are still waiting to be written, the caller blocks
+// until one is free, so memory use stays bounded.
+struct Cell_Snapshot_Record
+{
+    double position[3];
+    double radius;
+    double nuclear_radius;
+    int ID;
+    int type;
+    double oncoprotein;
+    double PDL1;
+    bool dead;
+    int phase_code;
+    Cell_Color_IDs colors;
+};
+
+struct Cell_Snapshot
+{
+    std::string filename_base;
+    double time;
+    std::vector<double> bounding_box;
+    std::vector<Cell_Snapshot_Record> records;
+};
+
+class Snapshot_Writer
+{
+ private:
+    Cell_Snapshot buffers[2];
+    bool queued[2]; // handed to the writer thread, not yet written
+    int fill_index; // buffer the next snapshot goes into
+    std::deque<int> write_queue;
+    bool running;
+    bool stopping;
+    
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread writer_thread;
+    
+    void run( void );
+    void write( const Cell_Snapshot& snapshot );
+ public:
+    Snapshot_Writer();
+    ~Snapshot_Writer();
+    
+    void start( void );
+    void queue( const std::string& filename_base, double time );
+    // write everything queued so far, then join the writer thread
+    void stop( void );
+};
+
+extern Snapshot_Writer snapshot_writer;
+
+void queue_cell_snapshot( std::string filename_base, double time );
+
 // cell rules for extra elastic adhesion
 
 /*
@@ -99,8 +339,80 @@ void attach_cells( Cell* pCell_1, Cell* pCell_2 );
 void dettach_cells( Cell* pCell_1 , Cell* pCell_2 );
 */
 void add_elastic_velocity( Cell* pActingOn, Cell* pAttachedTo , double elastic_constant ); 
+
+// two-phase attachment: rules running inside the parallel cell update
+// only record what they want into per-thread buffers, and the requests
+// are applied afterwards in a fixed order, with no locking. Kills are
+// requests too, so that several attackers on one target cannot race.
+enum Attachment_Request_Kind { kill_request = 0 , detach_request = 1 , attach_request = 2 };
+
+struct Attachment_Request
+{
+    Cell* pAttacker;
+    Cell* pTarget;
+    int kind; // Attachment_Request_Kind; applied in this order
+};
+
+void initialize_attachment_requests( void );
+void request_attachment( Cell* pAttacker, Cell* pTarget );
+void request_detachment( Cell* pAttacker, Cell* pTarget );
+void request_kill( Cell* pAttacker, Cell* pTarget );
+
+// docked pairs are recorded once per pair during the rule pass; the
+// stretch test runs over that flat list, not once from each side
+struct Attached_Pair
+{
+    Cell* pAttacker;
+    Cell* pTarget;
+};
+
+void record_attached_pair( Cell* pAttacker, Cell* pTarget );
+double attached_displacement( Cell* pFrom, Cell* pTo, double displacement[3] );
+void detach_stretched_pairs( void );
+
+// detach stretched pairs, then apply all recorded requests: kills (the
+// lowest attacker ID on a target wins), detachments, then attachments.
+// cancer_immune_diffusion_solver calls this first thing, which is serial
+// and between update_all_cells() calls; calling it again is harmless,
+// since the buffers are empty afterwards.
+void resolve_attachment_requests( void );
 void extra_elastic_attachment_mechanics( Cell* pCell, Phenotype& phenotype, double dt );
 
+// visit the cells in pCell's mechanics voxel and its Moore-connected
+// neighbor voxels, reading the Cell_Container agent grid in place (no
+// temporary vectors). Returns the first cell for which visit( pOther )
+// is true, or NULL if none is.
+template <typename Visitor>
+Cell* find_nearby_cell( Cell* pCell , Visitor visit )
+{
+    int voxel = pCell->get_current_mechanics_voxel_index();
+    if( voxel < 0 )
+    { return NULL; }
+    
+    Cell_Container* pContainer = pCell->get_container();
+    
+    const std::vector<Cell*>& my_voxel = pContainer->agent_grid[voxel];
+    for( int i=0; i < my_voxel.size(); i++ )
+    {
+        if( my_voxel[i] != pCell && visit( my_voxel[i] ) )
+        { return my_voxel[i]; }
+    }
+    
+    const std::vector<int>& neighbor_voxels =
+        pContainer->underlying_mesh.moore_connected_voxel_indices[voxel];
+    for( int n=0; n < neighbor_voxels.size(); n++ )
+    {
+        const std::vector<Cell*>& cells = pContainer->agent_grid[ neighbor_voxels[n] ];
+        for( int i=0; i < cells.size(); i++ )
+        {
+            if( visit( cells[i] ) )
+            { return cells[i]; }
+        }
+    }
+    
+    return NULL;
+}
+
 // immune cell functions for attacking a cell 
 Cell* immune_cell_check_neighbors_for_attachment( Cell* pAttacker , double dt ); 
 bool immune_cell_attempt_attachment( Cell* pAttacker, Cell* pTarget , double dt ); // only attack if oncoprotein 
@@ -109,6 +421,15 @@ bool immune_cell_trigger_apoptosis( Cell* pAttacker, Cell* pTarget );
 
 void immune_cell_rule( Cell* pCell, Phenotype& phenotype, double dt ); 
 
+// event-scheduled docking (docking_event_scheduling in mymodel.xml): when
+// a T cell docks, its kill and detachment times are drawn once from
+// their exponential distributions and stored in its custom_data. While
+// docked, immune_cell_rule only compares the current time against them,
+// instead of drawing two uniforms every mechanics step.
+extern bool docking_events_scheduled;
+void schedule_docking_events( Cell* pAttacker, Cell* pTarget );
+void immune_cell_docked_events( Cell* pCell, Phenotype& phenotype );
+
 void immune_cell_attach( Cell* pAttacker, Cell* pTarget ); // use attach_cells?? 
 void immune_cell_dettach( Cell* pAttacker, Cell* pTarget ); // use dettach_cells ?? 
 
@@ -124,9 +445,66 @@ void immune_cell_motility( Cell* pCell, Phenotype& phenotype, double dt );
 // custom to change color when PDL1 to make sure the function works
 std::vector<std::string> cancer_cell_PDL1_coloring_function( Cell* pCell);
 
+// death ledger: each cell reports its own death once (from its phenotype or
+// custom rule), and deaths are kept in a ring buffer of time bins spanning
+// dead_cell_time_window, so recent deaths are counted without scanning cells
+void initialize_death_ledger( void );
+// counts each death once, and marks it in the death_recorded custom variable
+void record_cell_death( Cell* pCell );
+void update_death_ledger( double current_time );
+
 // sum number of dead cells over time window, or Nc,death from Gong et al Cess et al models
 int sum_dead_cells_over_time_window ();
 
+// spatial extent of each cell type: distance of the farthest cell from the
+// origin, centroid, and (if extent_angular_sectors > 0) the farthest
+// distance within each azimuthal sector. Live cells add themselves from the
+// rules they already run, into per-thread accumulators stamped with the
+// time of the pass, so no sweep over all_cells is needed to query it.
+struct Spatial_Extent
+{
+    double time; // time of the update pass the data came from
+    int count;
+    double max_radius_squared;
+    std::vector<double> position_sum;
+    std::vector<double> max_radius_squared_by_sector;
+};
+
+void initialize_spatial_extents( void );
+void add_to_spatial_extent( Cell* pCell );
+// extent of a cell type as of its most recent update pass
+const Spatial_Extent& spatial_extent( int type );
+double spatial_extent_radius( int type );
+std::vector<double> spatial_extent_centroid( int type );
+
+// counter-based (Philox4x32-10) random numbers for use inside parallel
+// loops. a draw depends only on the seed, the event kind, a stream ID
+// (usually the cell ID), the current diffusion step and a draw index, so
+// there is no shared state and runs are reproducible at any thread count.
+// use a different draw index for each number needed from one stream in
+// the same step and event.
+enum Random_Event
+{
+    random_event_attachment = 0,
+    random_event_apoptosis,
+    random_event_detachment,
+    random_event_recruitment,
+    random_event_oncoprotein,
+    random_event_docking_kill,
+    random_event_docking_detach
+};
+
+void initialize_counter_random( unsigned int seed );
+long long counter_random_step( void );
+double counter_uniform_random( int event, unsigned long long stream, unsigned int draw );
+double counter_normal_random( int event, unsigned long long stream, unsigned int draw, double mean, double standard_deviation );
+double cell_uniform_random( Cell* pCell, int event, unsigned int draw = 0 );
+
+// create one cell of definition cd at each position (x,y,z packed, three
+// values per cell) as one batch: all_cells and the mechanics voxel agent
+// lists are grown once up front instead of cell by cell
+std::vector<Cell*> create_cells_at_positions( Cell_Definition& cd , const std::vector<double>& positions );
+
 // recruit number of T cells based on function provided by Gong et al Cess et al models
 void recruit_T_cells ();
 
@@ -134,9 +512,142 @@ void recruit_T_cells ();
 // macrophage functions
 // create macrophages
 void create_macrophage_type ( void );
-// macrophage rules
+// macrophage rules. macrophage_rule is installed as update_phenotype, so
+// it runs at phenotype_dt; live macrophages have no custom_cell_rule
 void macrophage_rule( Cell* pCell, Phenotype& phenotype, double dt );
 void macrophage_motility( Cell* pCell, Phenotype& phenotype, double dt );
 
+// compile-time behavior bundles for the three cell types; with
+// batched_custom_rules on, custom_cell_rule runs in run_batched_custom_rules()
+enum Cell_Policy
+{
+    no_cell_policy = 0,
+    cancer_cell_policy,
+    immune_cell_policy,
+    macrophage_cell_policy
+};
+
+struct Cancer_Cell_Policy
+{
+    static const int id = cancer_cell_policy;
+    static const bool has_update_phenotype = true;
+    static const bool has_custom_cell_rule = false;
+    static const bool has_update_migration_bias = false;
+    static const bool has_contact_function = true;
+    
+    static void update_phenotype( Cell* pCell, Phenotype& phenotype, double dt )
+    { tumor_cell_phenotype_with_and_immune_stimulation( pCell, phenotype, dt ); }
+    static void custom_cell_rule( Cell* pCell, Phenotype& phenotype, double dt ) {}
+    static void update_migration_bias( Cell* pCell, Phenotype& phenotype, double dt ) {}
+    static void contact_function( Cell* pActingOn, Phenotype& pao, Cell* pAttachedTo, Phenotype& pat, double dt )
+    { adhesion_contact_function( pActingOn, pao, pAttachedTo, pat, dt ); }
+};
+
+struct Immune_Cell_Policy
+{
+    static const int id = immune_cell_policy;
+    static const bool has_update_phenotype = false;
+    static const bool has_custom_cell_rule = true;
+    static const bool has_update_migration_bias = true;
+    static const bool has_contact_function = true;
+    
+    static void update_phenotype( Cell* pCell, Phenotype& phenotype, double dt ) {}
+    static void custom_cell_rule( Cell* pCell, Phenotype& phenotype, double dt )
+    { immune_cell_rule( pCell, phenotype, dt ); }
+    static void update_migration_bias( Cell* pCell, Phenotype& phenotype, double dt )
+    { immune_cell_motility( pCell, phenotype, dt ); }
+    static void contact_function( Cell* pActingOn, Phenotype& pao, Cell* pAttachedTo, Phenotype& pat, double dt )
+    { adhesion_contact_function( pActingOn, pao, pAttachedTo, pat, dt ); }
+};
+
+struct Macrophage_Policy
+{
+    static const int id = macrophage_cell_policy;
+    static const bool has_update_phenotype = true;
+    static const bool has_custom_cell_rule = false;
+    static const bool has_update_migration_bias = true;
+    static const bool has_contact_function = false;
+    
+    static void update_phenotype( Cell* pCell, Phenotype& phenotype, double dt )
+    { macrophage_rule( pCell, phenotype, dt ); }
+    static void custom_cell_rule( Cell* pCell, Phenotype& phenotype, double dt ) {}
+    static void update_migration_bias( Cell* pCell, Phenotype& phenotype, double dt )
+    { macrophage_motility( pCell, phenotype, dt ); }
+    static void contact_function( Cell* pActingOn, Phenotype& pao, Cell* pAttachedTo, Phenotype& pat, double dt ) {}
+};
+
+extern bool batched_custom_rules;
+extern std::vector<int> cell_policy_by_type; // no_cell_policy: no custom_cell_rule
+
+template <class Policy>
+void install_policy( Cell_Definition* pCD )
+{
+    Cell_Functions& functions = pCD->functions;
+    functions.update_phenotype = Policy::has_update_phenotype ? Policy::update_phenotype : NULL;
+    functions.custom_cell_rule = ( Policy::has_custom_cell_rule && !batched_custom_rules ) ? Policy::custom_cell_rule : NULL;
+    functions.update_migration_bias = Policy::has_update_migration_bias ? Policy::update_migration_bias : NULL;
+    functions.contact_function = Policy::has_contact_function ? Policy::contact_function : NULL;
+    
+    if( pCD->type >= cell_policy_by_type.size() )
+    { cell_policy_by_type.resize( pCD->type + 1 , no_cell_policy ); }
+    cell_policy_by_type[ pCD->type ] = Policy::has_custom_cell_rule ? Policy::id : no_cell_policy;
+    
+    return;
+}
+
+void run_batched_custom_rules( double t );
+
+// per-section timing, built with -DCANCER_IMMUNE_TIMING; write_section_timing()
+// appends one row per section to <output folder>/timing.csv
+enum Timed_Section
+{
+    timed_tumor_phenotype = 0,
+    timed_immune_cell_rule,
+    timed_immune_cell_motility,
+    timed_adhesion_contact,
+    timed_macrophage_rule,
+    timed_recruit_T_cells,
+    timed_diffusion,
+    timed_resolve_attachments,
+    timed_output,
+    timed_update_all_cells,
+    number_of_timed_sections
+};
+
+struct Section_Timing
+{
+    long long calls;
+    long long items; // cells (or voxels, or recruits) processed
+    double seconds;
+    char padding[40]; // one cache line per slot
+};
+
+void initialize_section_timing( void );
+void write_section_timing( double time );
+
+#ifdef CANCER_IMMUNE_TIMING
+
+class Scoped_Timer
+{
+ public:
+    Scoped_Timer( int section, long long items = 1 );
+    ~Scoped_Timer();
+ private:
+    int section;
+    long long items;
+    std::chrono::steady_clock::time_point start;
+};
+
+void add_timed_items( int section, long long items );
+
+#define CANCER_IMMUNE_TIMED_SCOPE( section ) Scoped_Timer cancer_immune_scoped_timer( section )
+#define CANCER_IMMUNE_TIMED_BATCH( section ) Scoped_Timer cancer_immune_scoped_timer( section , 0 )
+#define CANCER_IMMUNE_TIMED_ITEMS( section , items ) add_timed_items( section , items )
+
+#else
 
+#define CANCER_IMMUNE_TIMED_SCOPE( section )
+#define CANCER_IMMUNE_TIMED_BATCH( section )
+#define CANCER_IMMUNE_TIMED_ITEMS( section , items )
 
+#endif